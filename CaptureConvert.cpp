@@ -0,0 +1,412 @@
+/* Converts a gameplay capture (see FrameCapture.h) into pictures.
+ *
+ * The capture only holds draw calls, and the sprite images live inside the engine,
+ * so every sprite is rasterized as a SpriteSize square in a color picked by its
+ * Engine::Sprite value, and every character of a text as a FontWidth wide block.
+ * That's enough to see what happened in a clip, positions and timing are exact.
+ *
+ * Output is either a single Y4M stream, if the output path ends with ".y4m",
+ * or one PPM per frame named <output prefix>_<frame index>.ppm otherwise.
+ * Frames dropped during the capture are filled in with the previous frame in Y4M,
+ * so the clip keeps its timing, and skipped in PPM.
+ *
+ * This is a standalone tool, it doesn't need the engine or the game to build.
+ *
+ * Usage: CaptureConvert <capture file> <output.y4m | output prefix> [frame rate] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Must match FrameCapture.h */
+#define CAPTURE_VERSION 2
+#define CAPTURE_TEXTS_UNCHANGED 0xFF
+#define CAPTURE_TRAILER_MARKER 0xFFFFFFFF
+
+#define CONVERT_DEFAULT_FRAME_RATE 60
+#define CONVERT_MAX_SPRITES 65535
+#define CONVERT_MAX_TEXTS 255
+#define CONVERT_MAX_TEXT_LENGTH 65535
+
+struct Sprite
+{
+	uint8_t sprite;
+	int16_t x;
+	int16_t y;
+};
+
+struct Text
+{
+	int16_t x;
+	int16_t y;
+	uint16_t length;
+	char* chars;
+};
+
+/* Everything drawn in the last decoded frame, delta frames are applied on top of it. */
+struct DecodedFrame
+{
+	uint32_t frame_index;
+	float timestamp;
+	uint16_t num_sprites;
+	uint8_t num_texts;
+	Sprite* sprites;
+	Text texts[CONVERT_MAX_TEXTS];
+};
+
+struct CaptureHeader
+{
+	uint8_t delta;
+	uint16_t canvas_width;
+	uint16_t canvas_height;
+	uint16_t sprite_size;
+	uint16_t font_width;
+	uint16_t font_row_height;
+};
+
+/* Sprites are colored by their Engine::Sprite value, in the order of this table. */
+static const uint8_t sprite_palette[][3] = {
+    {80, 220, 80}, {220, 80, 80}, {220, 80, 220}, {240, 240, 80}, {240, 160, 40}, {80, 200, 240}};
+static const uint8_t text_color[3] = {230, 230, 230};
+
+inline uint8_t Read(FILE* file, void* dst, size_t size)
+{
+	return fread(dst, 1, size, file) == size;
+}
+
+inline uint8_t ReadSprite(FILE* file, Sprite* sprite)
+{
+	return Read(file, &sprite->sprite, sizeof(sprite->sprite)) &&
+	       Read(file, &sprite->x, sizeof(sprite->x)) && Read(file, &sprite->y, sizeof(sprite->y));
+}
+
+uint8_t ReadHeader(FILE* file, CaptureHeader* header)
+{
+	char magic[5];
+	uint8_t version;
+	if (!Read(file, magic, sizeof(magic)) || memcmp(magic, "SICAP", sizeof(magic)) ||
+	    !Read(file, &version, sizeof(version)))
+	{
+		fprintf(stderr, "Not a capture file.\n");
+		return 0;
+	}
+	if (version != CAPTURE_VERSION)
+	{
+		fprintf(stderr, "Unsupported capture version %d.\n", (int)version);
+		return 0;
+	}
+	return Read(file, &header->delta, sizeof(header->delta)) &&
+	       Read(file, &header->canvas_width, sizeof(header->canvas_width)) &&
+	       Read(file, &header->canvas_height, sizeof(header->canvas_height)) &&
+	       Read(file, &header->sprite_size, sizeof(header->sprite_size)) &&
+	       Read(file, &header->font_width, sizeof(header->font_width)) &&
+	       Read(file, &header->font_row_height, sizeof(header->font_row_height));
+}
+
+/* Decodes the record after the frame index into frame.
+ * Returns 0 if the file ends in the middle of the record. */
+uint8_t ReadFrame(FILE* file, const CaptureHeader* header, DecodedFrame* frame)
+{
+	uint16_t num_sprites;
+	if (!Read(file, &frame->timestamp, sizeof(frame->timestamp)) ||
+	    !Read(file, &num_sprites, sizeof(num_sprites)))
+	{
+		return 0;
+	}
+
+	if (header->delta)
+	{
+		/* Sprites that didn't change are kept from the previous frame. */
+		uint16_t num_changed;
+		if (!Read(file, &num_changed, sizeof(num_changed)))
+		{
+			return 0;
+		}
+		for (uint16_t i = 0; i < num_changed; ++i)
+		{
+			uint16_t index;
+			if (!Read(file, &index, sizeof(index)) || index >= num_sprites ||
+			    !ReadSprite(file, &frame->sprites[index]))
+			{
+				return 0;
+			}
+		}
+	}
+	else
+	{
+		for (uint16_t i = 0; i < num_sprites; ++i)
+		{
+			if (!ReadSprite(file, &frame->sprites[i]))
+			{
+				return 0;
+			}
+		}
+	}
+	frame->num_sprites = num_sprites;
+
+	uint8_t num_texts;
+	if (!Read(file, &num_texts, sizeof(num_texts)))
+	{
+		return 0;
+	}
+	if (header->delta && num_texts == CAPTURE_TEXTS_UNCHANGED)
+	{
+		return 1;
+	}
+	for (uint8_t i = 0; i < num_texts; ++i)
+	{
+		Text* text = &frame->texts[i];
+		if (!Read(file, &text->x, sizeof(text->x)) || !Read(file, &text->y, sizeof(text->y)) ||
+		    !Read(file, &text->length, sizeof(text->length)) ||
+		    !Read(file, text->chars, text->length))
+		{
+			return 0;
+		}
+	}
+	frame->num_texts = num_texts;
+	return 1;
+}
+
+/* Fills the clipped rectangle with the given color, canvas is packed RGB. */
+void FillRect(uint8_t* canvas,
+              const CaptureHeader* header,
+              int32_t x,
+              int32_t y,
+              int32_t width,
+              int32_t height,
+              const uint8_t* color)
+{
+	int32_t x0 = x < 0 ? 0 : x;
+	int32_t y0 = y < 0 ? 0 : y;
+	int32_t x1 = x + width > header->canvas_width ? header->canvas_width : x + width;
+	int32_t y1 = y + height > header->canvas_height ? header->canvas_height : y + height;
+	for (int32_t py = y0; py < y1; ++py)
+	{
+		uint8_t* row = canvas + ((size_t)py * header->canvas_width + x0) * 3;
+		for (int32_t px = x0; px < x1; ++px, row += 3)
+		{
+			memcpy(row, color, 3);
+		}
+	}
+}
+
+void RasterizeFrame(uint8_t* canvas, const CaptureHeader* header, const DecodedFrame* frame)
+{
+	const uint8_t num_colors = sizeof(sprite_palette) / sizeof(sprite_palette[0]);
+
+	memset(canvas, 0, (size_t)header->canvas_width * header->canvas_height * 3);
+
+	for (uint16_t i = 0; i < frame->num_sprites; ++i)
+	{
+		const Sprite* sprite = &frame->sprites[i];
+		FillRect(canvas,
+		         header,
+		         sprite->x,
+		         sprite->y,
+		         header->sprite_size,
+		         header->sprite_size,
+		         sprite_palette[sprite->sprite % num_colors]);
+	}
+
+	/* Leave a pixel between the characters and the rows, so words stay readable. */
+	for (uint8_t i = 0; i < frame->num_texts; ++i)
+	{
+		const Text* text = &frame->texts[i];
+		int32_t x = text->x;
+		int32_t y = text->y;
+		for (uint16_t c = 0; c < text->length; ++c)
+		{
+			if (text->chars[c] == '\n')
+			{
+				x = text->x;
+				y += header->font_row_height;
+				continue;
+			}
+			if (text->chars[c] != ' ')
+			{
+				FillRect(canvas,
+				         header,
+				         x,
+				         y,
+				         header->font_width - 1,
+				         header->font_row_height - 1,
+				         text_color);
+			}
+			x += header->font_width;
+		}
+	}
+}
+
+/* Full range BT.601, planar 4:4:4, so no chroma subsampling is needed. */
+uint8_t WriteY4MFrame(FILE* out,
+                      const uint8_t* canvas,
+                      const CaptureHeader* header,
+                      uint8_t* planes)
+{
+	const size_t num_pixels = (size_t)header->canvas_width * header->canvas_height;
+	for (size_t i = 0; i < num_pixels; ++i)
+	{
+		const float r = canvas[i * 3];
+		const float g = canvas[i * 3 + 1];
+		const float b = canvas[i * 3 + 2];
+		planes[i] = (uint8_t)(0.299f * r + 0.587f * g + 0.114f * b + 0.5f);
+		planes[num_pixels + i] = (uint8_t)(128.5f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+		planes[num_pixels * 2 + i] = (uint8_t)(128.5f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+	}
+	return fputs("FRAME\n", out) >= 0 && fwrite(planes, 1, num_pixels * 3, out) == num_pixels * 3;
+}
+
+uint8_t WritePPM(const char* prefix,
+                 uint32_t frame_index,
+                 const uint8_t* canvas,
+                 const CaptureHeader* header)
+{
+	char path[1024];
+	snprintf(path, sizeof(path), "%s_%06u.ppm", prefix, frame_index);
+	FILE* out = NULL;
+	if (fopen_s(&out, path, "wb") || !out)
+	{
+		fprintf(stderr, "Couldn't open %s for writing.\n", path);
+		return 0;
+	}
+	const size_t size = (size_t)header->canvas_width * header->canvas_height * 3;
+	uint8_t ok =
+	    fprintf(out, "P6\n%d %d\n255\n", header->canvas_width, header->canvas_height) > 0 &&
+	    fwrite(canvas, 1, size, out) == size;
+	fclose(out);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		fprintf(stderr,
+		        "Usage: %s <capture file> <output.y4m | output prefix> [frame rate]\n",
+		        argv[0]);
+		return 2;
+	}
+	const char* output_path = argv[2];
+	const size_t output_path_length = strlen(output_path);
+	const uint8_t y4m =
+	    output_path_length > 4 && !strcmp(output_path + output_path_length - 4, ".y4m");
+	const int frame_rate = argc > 3 ? atoi(argv[3]) : CONVERT_DEFAULT_FRAME_RATE;
+
+	FILE* file = NULL;
+	if (fopen_s(&file, argv[1], "rb") || !file)
+	{
+		fprintf(stderr, "Couldn't open %s.\n", argv[1]);
+		return 1;
+	}
+
+	CaptureHeader header;
+	if (!ReadHeader(file, &header))
+	{
+		fclose(file);
+		return 1;
+	}
+
+	/* Everything is allocated once, a frame can't exceed the limits of the format. */
+	DecodedFrame* frame = (DecodedFrame*)calloc(1, sizeof(DecodedFrame));
+	frame->sprites = (Sprite*)calloc(CONVERT_MAX_SPRITES, sizeof(Sprite));
+	for (uint8_t i = 0; i < CONVERT_MAX_TEXTS; ++i)
+	{
+		frame->texts[i].chars = (char*)malloc(CONVERT_MAX_TEXT_LENGTH);
+	}
+	const size_t canvas_size = (size_t)header.canvas_width * header.canvas_height * 3;
+	uint8_t* canvas = (uint8_t*)malloc(canvas_size);
+	uint8_t* planes = (uint8_t*)malloc(canvas_size);
+
+	FILE* out = NULL;
+	if (y4m)
+	{
+		if (fopen_s(&out, output_path, "wb") || !out)
+		{
+			fprintf(stderr, "Couldn't open %s for writing.\n", output_path);
+			return 1;
+		}
+		fprintf(out,
+		        "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n",
+		        header.canvas_width,
+		        header.canvas_height,
+		        frame_rate);
+	}
+
+	uint32_t frames_decoded = 0;
+	uint32_t frames_missing = 0;
+	uint32_t frames_written = 0;
+	uint8_t has_trailer = 0;
+	uint8_t failed = 0;
+	uint32_t frames_captured = 0;
+	uint32_t frames_dropped = 0;
+	uint32_t draws_truncated = 0;
+
+	uint32_t frame_index;
+	while (!failed && Read(file, &frame_index, sizeof(frame_index)))
+	{
+		if (frame_index == CAPTURE_TRAILER_MARKER)
+		{
+			has_trailer = Read(file, &frames_captured, sizeof(frames_captured)) &&
+			              Read(file, &frames_dropped, sizeof(frames_dropped)) &&
+			              Read(file, &draws_truncated, sizeof(draws_truncated));
+			break;
+		}
+		if (!ReadFrame(file, &header, frame))
+		{
+			fprintf(stderr, "Capture ends in the middle of frame %u.\n", frame_index);
+			break;
+		}
+
+		/* Frames dropped since the last one. */
+		const uint32_t gap = frames_decoded ? frame_index - frame->frame_index - 1 : 0;
+		frames_missing += gap;
+		frame->frame_index = frame_index;
+
+		if (y4m)
+		{
+			/* The canvas still holds the last frame before the gap. */
+			for (uint32_t i = 0; i < gap && !failed; ++i, ++frames_written)
+			{
+				failed = !WriteY4MFrame(out, canvas, &header, planes);
+			}
+			RasterizeFrame(canvas, &header, frame);
+			failed |= !WriteY4MFrame(out, canvas, &header, planes);
+		}
+		else
+		{
+			RasterizeFrame(canvas, &header, frame);
+			failed = !WritePPM(output_path, frame_index, canvas, &header);
+		}
+		frames_written++;
+		frames_decoded++;
+	}
+
+	if (failed)
+	{
+		fprintf(stderr, "Couldn't write the output.\n");
+	}
+
+	printf("Frames decoded: %u, missing: %u, written: %u\n",
+	       frames_decoded,
+	       frames_missing,
+	       frames_written);
+	if (has_trailer)
+	{
+		printf("Capture: %u frames captured, %u dropped, %u draw calls truncated\n",
+		       frames_captured,
+		       frames_dropped,
+		       draws_truncated);
+	}
+	else
+	{
+		printf("Capture has no trailer, the game didn't stop the capture.\n");
+	}
+
+	if (out)
+	{
+		fclose(out);
+	}
+	fclose(file);
+	return failed;
+}
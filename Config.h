@@ -24,6 +24,9 @@
 #define ALIEN_FORMATION_INNER_PADDING_X 10
 #define ALIEN_FORMATION_INNER_PADDING_Y 10
 #define ALIEN_BORDER_CORRECTION_MARGIN 5
+/* Number of alien formations that are alive at the same time.
+ * Whenever a formation is cleared, the next one in the wave takes its place. */
+#define ALIEN_NUM_CONCURRENT_FORMATIONS 2
 
 #define BOMB_MOVE_SPEED_PX_PER_SEC 80.0f
 #define ALIEN_BOMB_DROP_CHANCE_EACH_SEC 0.1f
@@ -56,14 +59,28 @@ static_assert(false);
 #define ALIEN_RANDOM_FORMATION 0
 #define ALIEN_RANDOM_ENEMY_TYPE 0
 
+/* Alien types. Formations of the same type are stored and processed together,
+ * so the type is an index into this table rather than the sprite itself. */
+#define ALIEN_NUM_TYPES 2
+static const Engine::Sprite ALIEN_TYPE_SPRITE[ALIEN_NUM_TYPES] = {Engine::Sprite::Enemy1,
+                                                                  Engine::Sprite::Enemy2};
+
 /* If random is set to 0, these values are going to be used cyclically. */
 #if (!ALIEN_RANDOM_FORMATION || !ALIEN_RANDOM_ENEMY_TYPE)
 #define ALIEN_NUM_PREDETERMINED_FORMATIONS 4
-static const Engine::Sprite ALIEN_PREDETERMINED_TYPE[ALIEN_NUM_PREDETERMINED_FORMATIONS] = {
-    Engine::Sprite::Enemy1,
-    Engine::Sprite::Enemy2,
-    Engine::Sprite::Enemy2,
-    Engine::Sprite::Enemy1};
+static const uint8_t ALIEN_PREDETERMINED_TYPE[ALIEN_NUM_PREDETERMINED_FORMATIONS] = {0, 1, 1, 0};
+/* Horizontal speed and initial direction of each predetermined formation.
+ * Formations moving to the left spawn at the right edge of the canvas. */
+static const float ALIEN_PREDETERMINED_SPEED[ALIEN_NUM_PREDETERMINED_FORMATIONS] = {
+    ALIENS_SPEED_PX_PER_SEC,
+    ALIENS_SPEED_PX_PER_SEC * 1.2f,
+    ALIENS_SPEED_PX_PER_SEC * 0.8f,
+    ALIENS_SPEED_PX_PER_SEC * 1.4f};
+static const int8_t ALIEN_PREDETERMINED_DIRECTION[ALIEN_NUM_PREDETERMINED_FORMATIONS] = {
+    ALIEN_INITIAL_DIRECTION,
+    -ALIEN_INITIAL_DIRECTION,
+    ALIEN_INITIAL_DIRECTION,
+    -ALIEN_INITIAL_DIRECTION};
 static const ALIEN_MASK_T ALIEN_PREDETERMINED_FORMATIONS[ALIEN_NUM_PREDETERMINED_FORMATIONS]
                                                         [ALIEN_FORMATION_NUM_ROWS] = {
                                                             {0x01, 0x20, 0x03, 0x6D},
@@ -72,6 +89,46 @@ static const ALIEN_MASK_T ALIEN_PREDETERMINED_FORMATIONS[ALIEN_NUM_PREDETERMINED
                                                             {0x63, 0xB1, 0x23, 0x18}};
 #endif
 
+/* FRAME CAPTURE SETTINGS. */
+/* Records the gameplay frames to FRAME_CAPTURE_PATH on a worker thread, see FrameCapture.h. */
+#define FRAME_CAPTURE 0
+#define FRAME_CAPTURE_PATH "capture.sicap"
+/* 1 to store each frame as the difference from the previous one, 0 to store full frames. */
+#define FRAME_CAPTURE_DELTA 1
+/* Number of frames that can wait for the encoder before frames start being dropped. */
+#define LOG_FRAME_CAPTURE_POOL_SIZE 4
+#define FRAME_CAPTURE_MAX_SPRITES 512
+#define FRAME_CAPTURE_MAX_TEXTS 4
+#define FRAME_CAPTURE_MAX_TEXT_LENGTH 192
+#define FRAME_CAPTURE_WRITE_BUFFER_SIZE (1 << 20)
+
+/* LOCKSTEP MULTIPLAYER SETTINGS. */
+/* Two players sharing one formation, each one simulating the same game on its own
+ * machine or process and exchanging only inputs over UDP, see Lockstep.h. */
+#define LOCKSTEP_MODE 0
+#define LOCKSTEP_REMOTE_ADDRESS "127.0.0.1"
+/* The first peer to start binds LOCKSTEP_PORT and becomes player 1,
+ * the second one binds LOCKSTEP_PORT + 1 and becomes player 2. */
+#define LOCKSTEP_PORT 27015
+/* The simulation runs at a fixed rate in lockstep mode, independent of the render rate. */
+#define LOCKSTEP_TICK_RATE 60
+/* Upper limit of ticks simulated in a single rendered frame, time beyond it is dropped
+ * instead of trying to catch up, e.g. after a stall. */
+#define LOCKSTEP_MAX_TICKS_PER_FRAME 4
+/* Frames between sampling an input and applying it, covers the network latency. */
+#define LOCKSTEP_INPUT_DELAY_FRAMES 6
+#define LOCKSTEP_SEND_INTERVAL_FRAMES 4
+/* Maximum number of unacknowledged inputs resent in every packet. */
+#define LOCKSTEP_REDUNDANT_INPUTS 8
+#define LOCKSTEP_RNG_SEED 0x5EED
+#define LOCKSTEP_TIMEOUT_MS 5000
+
+#if (LOCKSTEP_MODE)
+#define NUM_PLAYERS 2
+#else
+#define NUM_PLAYERS 1
+#endif
+
 /* COLLISION THRESHOLDS -- DON'T TOUCH THESE. */
 #define ROCKET_ALIEN_COLLISION_X_DIST 16
 #define ROCKET_ALIEN_COLLISION_Y_DIST 20
@@ -0,0 +1,411 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include "Config.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+/* Asynchronous gameplay recorder.
+ *
+ * Engine doesn't expose its framebuffer, so instead of pixels we record what makes up
+ * a frame: the draw calls issued between two startFrame calls. That is all a frame depends
+ * on, it's a few hundred bytes instead of a full canvas, and an offline tool can rasterize
+ * it into PPM/Y4M whenever a clip is needed, see CaptureConvert.cpp.
+ *
+ * The game thread only copies draw calls into a preallocated pool of frames.
+ * A worker thread encodes published frames into a large output buffer and writes it
+ * to disk in big sequential chunks. If the worker falls behind and the pool is full,
+ * the frame is dropped and counted, the game thread never waits.
+ * The game thread's share has to stay under 0.5 ms per frame. A full frame of
+ * FRAME_CAPTURE_MAX_SPRITES sprites and FRAME_CAPTURE_MAX_TEXTS texts costs about 10 us.
+ *
+ * File layout (little endian):
+ *   header: "SICAP" u8 version, u8 delta, u16 canvas width, u16 canvas height, u16 sprite size,
+ *           u16 font width, u16 font row height
+ *   frame:  u32 frame index, f32 timestamp, u16 num sprites, then
+ *           raw:   num sprites * {u8 sprite, i16 x, i16 y}
+ *           delta: u16 num changed, num changed * {u16 index, u8 sprite, i16 x, i16 y},
+ *                  sprites past the previous frame's count are always sent as changed
+ *           u8 num texts (0xFF in delta mode if texts are the same as the previous frame),
+ *           num texts * {i16 x, i16 y, u16 length, chars}
+ *   trailer: u32 0xFFFFFFFF, u32 frames captured, u32 frames dropped, u32 draws truncated
+ * Dropped frames show up as gaps in the frame index. A file without the trailer
+ * was cut short, the game didn't get to stop the capture. */
+
+#define FRAME_CAPTURE_VERSION 2
+#define FRAME_CAPTURE_POOL_SIZE (1 << LOG_FRAME_CAPTURE_POOL_SIZE)
+#define FRAME_CAPTURE_TEXTS_UNCHANGED 0xFF
+#define FRAME_CAPTURE_TRAILER_MARKER 0xFFFFFFFF
+
+struct CapturedSprite
+{
+	uint8_t sprite;
+	int16_t x;
+	int16_t y;
+};
+
+struct CapturedText
+{
+	int16_t x;
+	int16_t y;
+	uint16_t length;
+	char chars[FRAME_CAPTURE_MAX_TEXT_LENGTH];
+};
+
+struct CapturedFrame
+{
+	uint32_t frame_index;
+	float timestamp;
+	uint16_t num_sprites;
+	uint8_t num_texts;
+	CapturedSprite sprites[FRAME_CAPTURE_MAX_SPRITES];
+	CapturedText texts[FRAME_CAPTURE_MAX_TEXTS];
+};
+
+/* Worst case size of a single encoded frame, the output buffer is flushed
+ * whenever less than this is left in it. */
+static const size_t frame_capture_max_record_size =
+    12 + FRAME_CAPTURE_MAX_SPRITES * 7 + 1 +
+    FRAME_CAPTURE_MAX_TEXTS * (6 + FRAME_CAPTURE_MAX_TEXT_LENGTH);
+
+struct FrameCapture
+{
+	/* Ring of FRAME_CAPTURE_POOL_SIZE frames. The game thread fills the slot at head,
+	 * the worker encodes slots from tail up to head. */
+	CapturedFrame* pool = NULL;
+	std::atomic<uint32_t> head{0};
+	std::atomic<uint32_t> tail{0};
+	/* Slot being recorded this frame, NULL if the frame is being dropped. */
+	CapturedFrame* recording = NULL;
+
+	/* Game thread statistics. */
+	uint32_t frame_index = 0;
+	uint32_t frames_captured = 0;
+	uint32_t frames_dropped = 0;
+	uint32_t draws_truncated = 0;
+
+	/* Worker thread state. */
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable frame_published;
+	std::atomic<bool> running{false};
+	FILE* file = NULL;
+	uint8_t* out_buffer = NULL;
+	size_t out_size = 0;
+	/* Last encoded frame, used as the reference for delta compression. */
+	CapturedFrame* previous = NULL;
+	uint8_t delta = 0;
+	uint8_t write_failed = 0;
+};
+
+inline uint8_t* FrameCapturePut(uint8_t* out, const void* src, size_t size)
+{
+	memcpy(out, src, size);
+	return out + size;
+}
+
+inline void FrameCaptureFlush(FrameCapture* capture)
+{
+	if (capture->out_size &&
+	    fwrite(capture->out_buffer, 1, capture->out_size, capture->file) != capture->out_size)
+	{
+		capture->write_failed = 1;
+	}
+	capture->out_size = 0;
+}
+
+inline uint8_t* FrameCaptureEncodeSprite(uint8_t* out, const CapturedSprite* sprite)
+{
+	out = FrameCapturePut(out, &sprite->sprite, sizeof(sprite->sprite));
+	out = FrameCapturePut(out, &sprite->x, sizeof(sprite->x));
+	return FrameCapturePut(out, &sprite->y, sizeof(sprite->y));
+}
+
+inline uint8_t TextsEqual(const CapturedFrame* a, const CapturedFrame* b)
+{
+	if (a->num_texts != b->num_texts)
+	{
+		return 0;
+	}
+	for (uint8_t i = 0; i < a->num_texts; ++i)
+	{
+		const CapturedText* ta = &a->texts[i];
+		const CapturedText* tb = &b->texts[i];
+		if (ta->x != tb->x || ta->y != tb->y || ta->length != tb->length ||
+		    memcmp(ta->chars, tb->chars, ta->length))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Runs on the worker thread. */
+inline void EncodeCapturedFrame(FrameCapture* capture, const CapturedFrame* frame)
+{
+	if (FRAME_CAPTURE_WRITE_BUFFER_SIZE - capture->out_size < frame_capture_max_record_size)
+	{
+		FrameCaptureFlush(capture);
+	}
+
+	CapturedFrame* previous = capture->previous;
+	uint8_t* out = capture->out_buffer + capture->out_size;
+
+	out = FrameCapturePut(out, &frame->frame_index, sizeof(frame->frame_index));
+	out = FrameCapturePut(out, &frame->timestamp, sizeof(frame->timestamp));
+	out = FrameCapturePut(out, &frame->num_sprites, sizeof(frame->num_sprites));
+
+	if (capture->delta)
+	{
+		/* Reserve the changed count, it's known after the comparison. */
+		uint8_t* num_changed_out = out;
+		out += sizeof(uint16_t);
+		uint16_t num_changed = 0;
+		for (uint16_t i = 0; i < frame->num_sprites; ++i)
+		{
+			const CapturedSprite* s = &frame->sprites[i];
+			const CapturedSprite* p = &previous->sprites[i];
+			if (i >= previous->num_sprites || s->sprite != p->sprite || s->x != p->x ||
+			    s->y != p->y)
+			{
+				out = FrameCapturePut(out, &i, sizeof(i));
+				out = FrameCaptureEncodeSprite(out, s);
+				num_changed++;
+			}
+		}
+		memcpy(num_changed_out, &num_changed, sizeof(num_changed));
+	}
+	else
+	{
+		for (uint16_t i = 0; i < frame->num_sprites; ++i)
+		{
+			out = FrameCaptureEncodeSprite(out, &frame->sprites[i]);
+		}
+	}
+
+	if (capture->delta && TextsEqual(frame, previous))
+	{
+		*out++ = FRAME_CAPTURE_TEXTS_UNCHANGED;
+	}
+	else
+	{
+		*out++ = frame->num_texts;
+		for (uint8_t i = 0; i < frame->num_texts; ++i)
+		{
+			const CapturedText* text = &frame->texts[i];
+			out = FrameCapturePut(out, &text->x, sizeof(text->x));
+			out = FrameCapturePut(out, &text->y, sizeof(text->y));
+			out = FrameCapturePut(out, &text->length, sizeof(text->length));
+			out = FrameCapturePut(out, text->chars, text->length);
+		}
+	}
+
+	capture->out_size = out - capture->out_buffer;
+
+	if (capture->delta)
+	{
+		/* Only the used part of the frame is worth copying. */
+		previous->num_sprites = frame->num_sprites;
+		previous->num_texts = frame->num_texts;
+		memcpy(previous->sprites, frame->sprites, frame->num_sprites * sizeof(CapturedSprite));
+		memcpy(previous->texts, frame->texts, frame->num_texts * sizeof(CapturedText));
+	}
+}
+
+inline void FrameCaptureWorker(FrameCapture* capture)
+{
+	while (true)
+	{
+		uint32_t tail = capture->tail.load(std::memory_order_relaxed);
+		uint32_t head = capture->head.load(std::memory_order_acquire);
+		if (tail == head)
+		{
+			if (!capture->running.load(std::memory_order_acquire))
+			{
+				/* Check once more, the last frame could be published right before stopping. */
+				if (tail == capture->head.load(std::memory_order_acquire))
+				{
+					break;
+				}
+				continue;
+			}
+			/* The worker polls, the game thread only wakes it early when the pool is
+			 * half full. The timeout also covers a notification sent between the check
+			 * and the wait. */
+			std::unique_lock<std::mutex> lock(capture->mutex);
+			capture->frame_published.wait_for(lock, std::chrono::milliseconds(5));
+			continue;
+		}
+
+		for (; tail != head; ++tail)
+		{
+			EncodeCapturedFrame(capture, &capture->pool[tail & (FRAME_CAPTURE_POOL_SIZE - 1)]);
+			/* Hand the slot back to the game thread as soon as it's encoded. */
+			capture->tail.store(tail + 1, std::memory_order_release);
+		}
+	}
+	FrameCaptureFlush(capture);
+}
+
+/* Opens the output file and starts the worker. Memory is allocated once here,
+ * capturing itself never allocates. Returns 0 if the capture couldn't be started. */
+inline uint8_t StartFrameCapture(FrameCapture* capture, const char* path, uint8_t delta)
+{
+	if (fopen_s(&capture->file, path, "wb") || !capture->file)
+	{
+		return 0;
+	}
+	/* We do our own buffering, big writes should go straight to the OS. */
+	setvbuf(capture->file, NULL, _IONBF, 0);
+
+	capture->pool = (CapturedFrame*)malloc(FRAME_CAPTURE_POOL_SIZE * sizeof(CapturedFrame));
+	capture->previous = (CapturedFrame*)calloc(1, sizeof(CapturedFrame));
+	capture->out_buffer = (uint8_t*)malloc(FRAME_CAPTURE_WRITE_BUFFER_SIZE);
+	if (!capture->pool || !capture->previous || !capture->out_buffer)
+	{
+		exit(1);
+	}
+	capture->delta = delta;
+
+	uint8_t* out = capture->out_buffer;
+	const uint8_t version = FRAME_CAPTURE_VERSION;
+	const uint16_t canvas_width = Engine::CanvasWidth;
+	const uint16_t canvas_height = Engine::CanvasHeight;
+	const uint16_t sprite_size = Engine::SpriteSize;
+	const uint16_t font_width = Engine::FontWidth;
+	const uint16_t font_row_height = Engine::FontRowHeight;
+	out = FrameCapturePut(out, "SICAP", 5);
+	out = FrameCapturePut(out, &version, sizeof(version));
+	out = FrameCapturePut(out, &delta, sizeof(delta));
+	out = FrameCapturePut(out, &canvas_width, sizeof(canvas_width));
+	out = FrameCapturePut(out, &canvas_height, sizeof(canvas_height));
+	out = FrameCapturePut(out, &sprite_size, sizeof(sprite_size));
+	out = FrameCapturePut(out, &font_width, sizeof(font_width));
+	out = FrameCapturePut(out, &font_row_height, sizeof(font_row_height));
+	capture->out_size = out - capture->out_buffer;
+
+	capture->recording = NULL;
+	capture->running.store(true, std::memory_order_release);
+	capture->worker = std::thread(FrameCaptureWorker, capture);
+	return 1;
+}
+
+/* Called right after Engine::startFrame. Publishes the frame recorded since the previous
+ * call and picks the slot for the next one, or drops it if the pool is full. */
+inline void CaptureStartFrame(FrameCapture* capture, double timestamp)
+{
+	uint32_t head = capture->head.load(std::memory_order_relaxed);
+	if (capture->recording)
+	{
+		capture->head.store(++head, std::memory_order_release);
+		capture->frames_captured++;
+		/* Waking the worker is a system call, normally publishing is just the store above. */
+		if (head - capture->tail.load(std::memory_order_relaxed) >= FRAME_CAPTURE_POOL_SIZE / 2)
+		{
+			capture->frame_published.notify_one();
+		}
+	}
+
+	if (head - capture->tail.load(std::memory_order_acquire) < FRAME_CAPTURE_POOL_SIZE)
+	{
+		CapturedFrame* frame = &capture->pool[head & (FRAME_CAPTURE_POOL_SIZE - 1)];
+		frame->frame_index = capture->frame_index;
+		frame->timestamp = (float)timestamp;
+		frame->num_sprites = 0;
+		frame->num_texts = 0;
+		capture->recording = frame;
+	}
+	else
+	{
+		capture->frames_dropped++;
+		capture->recording = NULL;
+	}
+	capture->frame_index++;
+}
+
+inline void CaptureSprite(FrameCapture* capture, Engine::Sprite sprite, int32_t x, int32_t y)
+{
+	CapturedFrame* frame = capture->recording;
+	if (frame->num_sprites < FRAME_CAPTURE_MAX_SPRITES)
+	{
+		CapturedSprite* s = &frame->sprites[frame->num_sprites++];
+		s->sprite = (uint8_t)sprite;
+		s->x = (int16_t)x;
+		s->y = (int16_t)y;
+	}
+	else
+	{
+		capture->draws_truncated++;
+	}
+}
+
+inline void CaptureText(FrameCapture* capture, const char* message, int32_t x, int32_t y)
+{
+	CapturedFrame* frame = capture->recording;
+	if (frame->num_texts < FRAME_CAPTURE_MAX_TEXTS)
+	{
+		CapturedText* text = &frame->texts[frame->num_texts++];
+		size_t length = strlen(message);
+		if (length > FRAME_CAPTURE_MAX_TEXT_LENGTH)
+		{
+			length = FRAME_CAPTURE_MAX_TEXT_LENGTH;
+			capture->draws_truncated++;
+		}
+		text->x = (int16_t)x;
+		text->y = (int16_t)y;
+		text->length = (uint16_t)length;
+		memcpy(text->chars, message, length);
+	}
+	else
+	{
+		capture->draws_truncated++;
+	}
+}
+
+/* Publishes the last frame, waits for the worker to drain the pool, then appends the trailer
+ * with the statistics and closes the file. */
+inline void StopFrameCapture(FrameCapture* capture)
+{
+	if (!capture->file)
+	{
+		return;
+	}
+	if (capture->recording)
+	{
+		capture->head.store(capture->head.load(std::memory_order_relaxed) + 1,
+		                    std::memory_order_release);
+		capture->frames_captured++;
+		capture->recording = NULL;
+	}
+	capture->running.store(false, std::memory_order_release);
+	capture->frame_published.notify_one();
+	capture->worker.join();
+
+	/* The worker has flushed everything, the buffer is ours again. */
+	uint8_t* out = capture->out_buffer;
+	const uint32_t marker = FRAME_CAPTURE_TRAILER_MARKER;
+	out = FrameCapturePut(out, &marker, sizeof(marker));
+	out = FrameCapturePut(out, &capture->frames_captured, sizeof(capture->frames_captured));
+	out = FrameCapturePut(out, &capture->frames_dropped, sizeof(capture->frames_dropped));
+	out = FrameCapturePut(out, &capture->draws_truncated, sizeof(capture->draws_truncated));
+	capture->out_size = out - capture->out_buffer;
+	FrameCaptureFlush(capture);
+
+	fclose(capture->file);
+	capture->file = NULL;
+	free(capture->pool);
+	free(capture->previous);
+	free(capture->out_buffer);
+	capture->pool = NULL;
+	capture->previous = NULL;
+	capture->out_buffer = NULL;
+}
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "Config.h"
+#include <chrono>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET lockstep_socket_t;
+typedef int lockstep_socklen_t;
+#define LOCKSTEP_INVALID_SOCKET INVALID_SOCKET
+#define LockstepCloseSocket closesocket
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int lockstep_socket_t;
+typedef socklen_t lockstep_socklen_t;
+#define LOCKSTEP_INVALID_SOCKET (-1)
+#define LockstepCloseSocket close
+#endif
+
+/* Deterministic lockstep over UDP for two players.
+ *
+ * Both peers run the exact same simulation with a fixed time step, the only thing
+ * exchanged is the input of each player for each frame. Input sampled at frame f is
+ * scheduled for frame f + LOCKSTEP_INPUT_DELAY_FRAMES, which gives it time to reach the
+ * other peer before it's needed. A frame is simulated only when the inputs of both
+ * players for it are known, otherwise the game stalls.
+ *
+ * Every LOCKSTEP_SEND_INTERVAL_FRAMES frames a packet is sent with all the local inputs
+ * the peer hasn't acknowledged yet (up to LOCKSTEP_REDUNDANT_INPUTS of them), so a lost
+ * packet is covered by the next one. Packets also carry the hash of the last simulated
+ * frame for desync detection, and a timestamp echo for measuring the round trip.
+ *
+ * Packet layout (little endian, 17 bytes + inputs):
+ *   u8 type, u16 first input frame, u8 num inputs, u16 ack, u16 hash frame, u32 hash,
+ *   u16 stamp, u16 echo, u8 echo hold, inputs packed as 4 bit nibbles.
+ * Frame numbers are sent as their low 16 bits and reconstructed on the receiving end. */
+
+#define LOCKSTEP_INPUT_BUFFER_SIZE 64
+#define LOCKSTEP_PACKET_HELLO 0
+#define LOCKSTEP_PACKET_INPUT 1
+#define LOCKSTEP_NO_ECHO 0xFF
+
+static const uint32_t lockstep_packet_size = 17 + (LOCKSTEP_REDUNDANT_INPUTS + 1) / 2;
+/* Payload plus 28 bytes of IPv4 and UDP headers for every packet. */
+static const uint32_t lockstep_bytes_per_sec =
+    (lockstep_packet_size + 28) * LOCKSTEP_TICK_RATE / LOCKSTEP_SEND_INTERVAL_FRAMES;
+static_assert(lockstep_bytes_per_sec < 1024, "Lockstep traffic must stay under 1 KB/s.");
+static_assert(LOCKSTEP_REDUNDANT_INPUTS >= LOCKSTEP_SEND_INTERVAL_FRAMES,
+              "Every input has to be sent at least once.");
+static_assert(2 * LOCKSTEP_INPUT_DELAY_FRAMES < LOCKSTEP_INPUT_BUFFER_SIZE,
+              "Input delay doesn't fit into the input buffer.");
+
+struct Lockstep
+{
+	lockstep_socket_t socket = LOCKSTEP_INVALID_SOCKET;
+	sockaddr_in remote;
+	/* 0 or 1, the index of the player controlled by this peer. */
+	uint8_t local_player = 0;
+	uint8_t connected = 0;
+
+	/* Next frame to be simulated. */
+	uint32_t frame = 0;
+	/* Inputs of each player, packed as left | right << 1 | fire << 2, indexed by frame. */
+	uint8_t inputs[2][LOCKSTEP_INPUT_BUFFER_SIZE];
+	/* Local inputs are known for the frames before local_input_end,
+	 * remote inputs for the frames before remote_input_end. */
+	uint32_t local_input_end = 0;
+	uint32_t remote_input_end = 0;
+	/* The peer has received our inputs for all the frames before remote_ack. */
+	uint32_t remote_ack = 0;
+
+	/* Hashes of the last simulated frames, and the peer's hash for a frame we haven't
+	 * simulated yet, if it's ahead of us. */
+	uint32_t hashes[LOCKSTEP_INPUT_BUFFER_SIZE];
+	uint32_t pending_hash_frame = 0;
+	uint32_t pending_hash = 0;
+	uint8_t has_pending_hash = 0;
+
+	/* Round trip measurement. */
+	std::chrono::steady_clock::time_point epoch;
+	uint16_t last_remote_stamp = 0;
+	uint32_t last_remote_stamp_received_ms = 0;
+	uint8_t has_remote_stamp = 0;
+	uint32_t last_sent_ms = 0;
+
+	/* Statistics. */
+	float rtt_ms = 0.0f;
+	uint32_t stall_frames = 0;
+	uint32_t desyncs = 0;
+	uint32_t first_desync_frame = 0;
+	uint32_t packets_sent = 0;
+	uint32_t packets_received = 0;
+};
+
+inline uint32_t LockstepNowMs(const Lockstep* lockstep)
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+	           std::chrono::steady_clock::now() - lockstep->epoch)
+	    .count();
+}
+
+/* Reconstructs a full frame number from its low 16 bits, picking the one closest to reference. */
+inline uint32_t LockstepUnwrapFrame(uint16_t wire, uint32_t reference)
+{
+	return reference + (int16_t)(uint16_t)(wire - (uint16_t)reference);
+}
+
+inline uint8_t PackInput(Engine::PlayerInput input)
+{
+	return (uint8_t)input.left | (uint8_t)input.right << 1 | (uint8_t)input.fire << 2;
+}
+
+inline Engine::PlayerInput UnpackInput(uint8_t packed)
+{
+	Engine::PlayerInput input;
+	input.left = packed & 0x01;
+	input.right = (packed >> 1) & 0x01;
+	input.fire = (packed >> 2) & 0x01;
+	return input;
+}
+
+/* 32 bit FNV-1a, used for the per frame state hashes. */
+inline uint32_t Fnv1a(uint32_t hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+static const uint32_t fnv1a_offset_basis = 2166136261u;
+
+/* Binds LOCKSTEP_PORT, or LOCKSTEP_PORT + 1 if another peer on this machine already has it.
+ * The peer on LOCKSTEP_PORT is player 1 and sends to LOCKSTEP_PORT + 1, and vice versa.
+ * Returns 0 if no socket could be opened. */
+inline uint8_t LockstepOpen(Lockstep* lockstep)
+{
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data))
+	{
+		return 0;
+	}
+#endif
+	lockstep->epoch = std::chrono::steady_clock::now();
+
+	for (uint8_t player = 0; player < 2; ++player)
+	{
+		lockstep_socket_t s = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if (s == LOCKSTEP_INVALID_SOCKET)
+		{
+			return 0;
+		}
+		sockaddr_in local;
+		memset(&local, 0, sizeof(local));
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		local.sin_port = htons((uint16_t)(LOCKSTEP_PORT + player));
+		if (bind(s, (sockaddr*)&local, sizeof(local)))
+		{
+			LockstepCloseSocket(s);
+			continue;
+		}
+
+#ifdef _WIN32
+		u_long non_blocking = 1;
+		ioctlsocket(s, FIONBIO, &non_blocking);
+#else
+		fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+#endif
+		memset(&lockstep->remote, 0, sizeof(lockstep->remote));
+		lockstep->remote.sin_family = AF_INET;
+		lockstep->remote.sin_port = htons((uint16_t)(LOCKSTEP_PORT + (player ^ 1)));
+		inet_pton(AF_INET, LOCKSTEP_REMOTE_ADDRESS, &lockstep->remote.sin_addr);
+
+		lockstep->socket = s;
+		lockstep->local_player = player;
+		break;
+	}
+	if (lockstep->socket == LOCKSTEP_INVALID_SOCKET)
+	{
+		return 0;
+	}
+
+	/* Nobody moves during the first frames, until the delayed inputs kick in. */
+	memset(lockstep->inputs, 0, sizeof(lockstep->inputs));
+	memset(lockstep->hashes, 0, sizeof(lockstep->hashes));
+	lockstep->local_input_end = LOCKSTEP_INPUT_DELAY_FRAMES;
+	lockstep->remote_input_end = LOCKSTEP_INPUT_DELAY_FRAMES;
+	lockstep->remote_ack = LOCKSTEP_INPUT_DELAY_FRAMES;
+	return 1;
+}
+
+inline void LockstepClose(Lockstep* lockstep)
+{
+	if (lockstep->socket != LOCKSTEP_INVALID_SOCKET)
+	{
+		LockstepCloseSocket(lockstep->socket);
+		lockstep->socket = LOCKSTEP_INVALID_SOCKET;
+#ifdef _WIN32
+		WSACleanup();
+#endif
+	}
+}
+
+inline void LockstepSend(Lockstep* lockstep, uint8_t type)
+{
+	uint8_t packet[lockstep_packet_size];
+	memset(packet, 0, sizeof(packet));
+
+	/* Everything the peer hasn't acknowledged, oldest first, since the newer inputs
+	 * are useless to it without the older ones. */
+	uint32_t first = lockstep->remote_ack;
+	uint32_t num_inputs = lockstep->local_input_end - first;
+	if (num_inputs > LOCKSTEP_REDUNDANT_INPUTS)
+	{
+		num_inputs = LOCKSTEP_REDUNDANT_INPUTS;
+	}
+
+	const uint32_t now = LockstepNowMs(lockstep);
+	const uint16_t first_wire = (uint16_t)first;
+	const uint16_t ack_wire = (uint16_t)lockstep->remote_input_end;
+	const uint16_t hash_frame_wire = (uint16_t)(lockstep->frame - 1);
+	const uint32_t hash =
+	    lockstep->hashes[(lockstep->frame - 1) & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)];
+	const uint16_t stamp = (uint16_t)now;
+	const uint16_t echo = lockstep->last_remote_stamp;
+	uint32_t echo_hold = now - lockstep->last_remote_stamp_received_ms;
+	if (!lockstep->has_remote_stamp || echo_hold >= LOCKSTEP_NO_ECHO)
+	{
+		echo_hold = LOCKSTEP_NO_ECHO;
+	}
+
+	packet[0] = type;
+	memcpy(&packet[1], &first_wire, 2);
+	packet[3] = (uint8_t)num_inputs;
+	memcpy(&packet[4], &ack_wire, 2);
+	memcpy(&packet[6], &hash_frame_wire, 2);
+	memcpy(&packet[8], &hash, 4);
+	memcpy(&packet[12], &stamp, 2);
+	memcpy(&packet[14], &echo, 2);
+	packet[16] = (uint8_t)echo_hold;
+	for (uint32_t i = 0; i < num_inputs; ++i)
+	{
+		uint8_t input = lockstep->inputs[lockstep->local_player]
+		                                [(first + i) & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)];
+		packet[17 + (i >> 1)] |= (uint8_t)(input << ((i & 0x01) << 2));
+	}
+
+	sendto(lockstep->socket,
+	       (const char*)packet,
+	       17 + (num_inputs + 1) / 2,
+	       0,
+	       (const sockaddr*)&lockstep->remote,
+	       sizeof(lockstep->remote));
+	lockstep->packets_sent++;
+	lockstep->last_sent_ms = now;
+}
+
+inline void LockstepCheckHash(Lockstep* lockstep, uint32_t frame, uint32_t hash)
+{
+	if (lockstep->hashes[frame & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)] != hash)
+	{
+		if (!lockstep->desyncs)
+		{
+			lockstep->first_desync_frame = frame;
+		}
+		lockstep->desyncs++;
+	}
+}
+
+/* Drains all the packets waiting in the socket. The socket is bound to every interface,
+ * so anything that doesn't come from the peer's address and port is dropped. */
+inline void LockstepReceive(Lockstep* lockstep)
+{
+	uint8_t packet[64];
+	const uint8_t remote_player = lockstep->local_player ^ 1;
+
+	while (true)
+	{
+		sockaddr_in source;
+		lockstep_socklen_t source_size = sizeof(source);
+		int size = (int)recvfrom(lockstep->socket,
+		                         (char*)packet,
+		                         sizeof(packet),
+		                         0,
+		                         (sockaddr*)&source,
+		                         &source_size);
+		if (size < 0)
+		{
+			/* Nothing left. On Windows, an ICMP port unreachable from a peer that
+			 * isn't up yet also ends up here as an error. */
+			break;
+		}
+		if (size < 17 || source_size < (lockstep_socklen_t)sizeof(source) ||
+		    source.sin_family != AF_INET ||
+		    source.sin_addr.s_addr != lockstep->remote.sin_addr.s_addr ||
+		    source.sin_port != lockstep->remote.sin_port)
+		{
+			/* Not one of ours. */
+			continue;
+		}
+		lockstep->packets_received++;
+		lockstep->connected = 1;
+
+		const uint32_t now = LockstepNowMs(lockstep);
+		uint16_t first_wire, ack_wire, hash_frame_wire, stamp, echo;
+		uint32_t hash;
+		memcpy(&first_wire, &packet[1], 2);
+		uint32_t num_inputs = packet[3];
+		memcpy(&ack_wire, &packet[4], 2);
+		memcpy(&hash_frame_wire, &packet[6], 2);
+		memcpy(&hash, &packet[8], 4);
+		memcpy(&stamp, &packet[12], 2);
+		memcpy(&echo, &packet[14], 2);
+		uint8_t echo_hold = packet[16];
+
+		if ((uint32_t)size < 17 + (num_inputs + 1) / 2)
+		{
+			continue;
+		}
+
+		lockstep->last_remote_stamp = stamp;
+		lockstep->last_remote_stamp_received_ms = now;
+		lockstep->has_remote_stamp = 1;
+		if (echo_hold != LOCKSTEP_NO_ECHO)
+		{
+			float rtt = (float)(uint16_t)((uint16_t)now - echo - echo_hold);
+			lockstep->rtt_ms = lockstep->rtt_ms ? lockstep->rtt_ms * 0.9f + rtt * 0.1f : rtt;
+		}
+
+		if (packet[0] != LOCKSTEP_PACKET_INPUT)
+		{
+			continue;
+		}
+
+		uint32_t ack = LockstepUnwrapFrame(ack_wire, lockstep->remote_ack);
+		if ((int32_t)(ack - lockstep->remote_ack) > 0)
+		{
+			lockstep->remote_ack = ack;
+		}
+
+		/* Append the inputs that extend the contiguous range we have. */
+		uint32_t first = LockstepUnwrapFrame(first_wire, lockstep->remote_input_end);
+		for (uint32_t i = 0; i < num_inputs; ++i)
+		{
+			uint32_t f = first + i;
+			if (f != lockstep->remote_input_end ||
+			    f - lockstep->frame >= LOCKSTEP_INPUT_BUFFER_SIZE)
+			{
+				continue;
+			}
+			lockstep->inputs[remote_player][f & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)] =
+			    (packet[17 + (i >> 1)] >> ((i & 0x01) << 2)) & 0x0F;
+			lockstep->remote_input_end++;
+		}
+
+		/* Compare the peer's hash against ours if we've simulated that frame,
+		 * otherwise keep it around until we do. A peer that hasn't simulated
+		 * anything yet sends frame -1. */
+		uint32_t hash_frame = LockstepUnwrapFrame(hash_frame_wire, lockstep->frame);
+		if (hash_frame != 0xFFFFFFFF)
+		{
+			int32_t age = (int32_t)(lockstep->frame - hash_frame);
+			if (age > 0 && age <= LOCKSTEP_INPUT_BUFFER_SIZE)
+			{
+				LockstepCheckHash(lockstep, hash_frame, hash);
+			}
+			else if (age <= 0)
+			{
+				lockstep->pending_hash_frame = hash_frame;
+				lockstep->pending_hash = hash;
+				lockstep->has_pending_hash = 1;
+			}
+		}
+	}
+}
+
+/* Called once per rendered frame before the game starts, returns 1 once the peer is there. */
+inline uint8_t LockstepPollConnection(Lockstep* lockstep)
+{
+	LockstepReceive(lockstep);
+	if (LockstepNowMs(lockstep) - lockstep->last_sent_ms >= 100)
+	{
+		LockstepSend(lockstep, LOCKSTEP_PACKET_HELLO);
+	}
+	return lockstep->connected;
+}
+
+/* Schedules the local input sampled this frame for frame + LOCKSTEP_INPUT_DELAY_FRAMES. */
+inline void LockstepAddLocalInput(Lockstep* lockstep, Engine::PlayerInput input)
+{
+	if (lockstep->local_input_end - lockstep->frame < LOCKSTEP_INPUT_DELAY_FRAMES + 1)
+	{
+		lockstep->inputs[lockstep->local_player]
+		                [lockstep->local_input_end & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)] =
+		    PackInput(input);
+		lockstep->local_input_end++;
+	}
+}
+
+/* Blocks until the inputs of both players for the current frame are known.
+ * Returns 0 if the peer went silent for longer than LOCKSTEP_TIMEOUT_MS. */
+inline uint8_t LockstepWaitForInputs(Lockstep* lockstep, Engine::PlayerInput inputs[2])
+{
+	const uint32_t resend_interval_ms = 1000 * LOCKSTEP_SEND_INTERVAL_FRAMES / LOCKSTEP_TICK_RATE;
+	const uint32_t wait_start = LockstepNowMs(lockstep);
+	uint8_t stalled = 0;
+
+	LockstepReceive(lockstep);
+	/* Also wait if the peer is so far behind on acknowledgements that the inputs
+	 * it's missing would be overwritten. */
+	while (lockstep->remote_input_end == lockstep->frame ||
+	       lockstep->local_input_end - lockstep->remote_ack >= LOCKSTEP_INPUT_BUFFER_SIZE)
+	{
+		stalled = 1;
+		uint32_t now = LockstepNowMs(lockstep);
+		if (now - wait_start > LOCKSTEP_TIMEOUT_MS)
+		{
+			return 0;
+		}
+		/* Our last packet might be what got lost, the peer could be waiting for us too. */
+		if (now - lockstep->last_sent_ms >= resend_interval_ms)
+		{
+			LockstepSend(lockstep, LOCKSTEP_PACKET_INPUT);
+		}
+
+		fd_set read_set;
+		FD_ZERO(&read_set);
+		FD_SET(lockstep->socket, &read_set);
+		timeval timeout = {0, 1000};
+		select((int)lockstep->socket + 1, &read_set, NULL, NULL, &timeout);
+		LockstepReceive(lockstep);
+	}
+	lockstep->stall_frames += stalled;
+
+	const uint32_t slot = lockstep->frame & (LOCKSTEP_INPUT_BUFFER_SIZE - 1);
+	inputs[0] = UnpackInput(lockstep->inputs[0][slot]);
+	inputs[1] = UnpackInput(lockstep->inputs[1][slot]);
+	return 1;
+}
+
+/* Keeps resending our last inputs after the game is over, until the peer gets them. */
+inline void LockstepLinger(Lockstep* lockstep)
+{
+	const uint32_t resend_interval_ms = 1000 * LOCKSTEP_SEND_INTERVAL_FRAMES / LOCKSTEP_TICK_RATE;
+	LockstepReceive(lockstep);
+	if (lockstep->remote_ack != lockstep->local_input_end &&
+	    LockstepNowMs(lockstep) - lockstep->last_sent_ms >= resend_interval_ms)
+	{
+		LockstepSend(lockstep, LOCKSTEP_PACKET_INPUT);
+	}
+}
+
+/* Records the hash of the frame that was just simulated and moves on to the next one. */
+inline void LockstepEndFrame(Lockstep* lockstep, uint32_t hash)
+{
+	const uint32_t frame = lockstep->frame;
+	lockstep->hashes[frame & (LOCKSTEP_INPUT_BUFFER_SIZE - 1)] = hash;
+	if (lockstep->has_pending_hash && lockstep->pending_hash_frame == frame)
+	{
+		LockstepCheckHash(lockstep, frame, lockstep->pending_hash);
+		lockstep->has_pending_hash = 0;
+	}
+	lockstep->frame++;
+
+	if (!(lockstep->frame % LOCKSTEP_SEND_INTERVAL_FRAMES))
+	{
+		LockstepSend(lockstep, LOCKSTEP_PACKET_INPUT);
+	}
+}
+
+#endif
@@ -0,0 +1,606 @@
+/* Frame budget regression suite.
+ *
+ * Runs a fixed set of scripted scenarios through GameFrame, headless, and compares
+ * frames/sec, the 99th percentile of the single frame times and work counted per frame
+ * (see WorkCounter) against the baseline, so it can gate a release. Exits with
+ *   0 if every scenario is within its tolerance,
+ *   1 if any scenario regressed beyond its tolerance, or the suite couldn't run,
+ *   2 if any scenario has no baseline yet and none regressed.
+ *
+ * Timings only mean something on the machine they were recorded on, so no numbers are
+ * checked in, and until the baseline is recorded the suite exits with 2. Bootstrap the
+ * gate by running --write-baseline once on the release machine, with the release build,
+ * and checking in the perf_baseline.txt it writes. A new scenario needs the same.
+ *
+ * The game is a single translation unit, so this is built as its own executable from
+ * this file alone. It only needs Engine.h, not the engine library.
+ *
+ * Usage: PerfRegression [baseline file] [--write-baseline] */
+
+#define SPACE_INVADERS_HEADLESS
+#include "SpaceInvaders.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define PERF_BASELINE_PATH "perf_baseline.txt"
+#define PERF_EXIT_PASSED 0
+#define PERF_EXIT_REGRESSED 1
+#define PERF_EXIT_NO_BASELINE 2
+#define PERF_TIMESTEP (1.0f / 60.0f)
+#define PERF_WARMUP_FRAMES 120
+/* Every run of a scenario starts from this seed, so all of them replay the same workload. */
+#define PERF_RNG_SEED 1
+/* Frames/sec and the work counter are measured over batches of this many frames, reading
+ * the clock and the counter around every frame would cost more than some of the frames. */
+#define PERF_FRAMES_PER_SAMPLE 100
+/* The opening scenarios restart the game this often, so the formations stay near the top
+ * instead of marching off the bottom of the canvas over a long run. */
+#define PERF_OPENING_FRAMES 300
+/* Every scenario is run this many times and the best run is kept,
+ * which filters out most of the noise from the rest of the system. */
+#define PERF_REPETITIONS 5
+
+/* Tolerances written into a fresh baseline. Timings are noisy, instruction counts aren't,
+ * thread cycles are somewhere in between. */
+#define PERF_DEFAULT_FPS_TOLERANCE 0.25f
+#define PERF_DEFAULT_P99_TOLERANCE 0.50f
+#if defined(_WIN32)
+#define PERF_DEFAULT_COUNTER_TOLERANCE 0.10f
+#else
+#define PERF_DEFAULT_COUNTER_TOLERANCE 0.05f
+#endif
+
+/* Counts the draw calls instead of drawing, so the engine's cost stays out of the numbers. */
+struct HeadlessRenderer
+{
+	u64 num_sprites = 0;
+
+	inline void drawSprite(Engine::Sprite, pixel_wide_t, pixel_wide_t)
+	{
+		num_sprites++;
+	}
+};
+
+/* Counts the work done by this thread, which unlike the timings doesn't depend on what
+ * the rest of the system is doing.
+ *   Windows: cycles charged to the thread, through QueryThreadCycleTime. There's no user
+ *            mode API for instructions retired, but the thread's cycles leave out the
+ *            time it was switched out.
+ *   Linux:   user space instructions retired, through perf_event_open, if the kernel
+ *            lets us read the hardware counters.
+ * Baselines only compare counts taken with the same counter. */
+struct WorkCounter
+{
+	/* "none" if there's no counter. */
+	const char* name = "none";
+#if defined(_WIN32)
+	HANDLE thread = NULL;
+#elif defined(__linux__)
+	int fd = -1;
+#endif
+};
+
+inline void OpenWorkCounter(WorkCounter* counter)
+{
+#if defined(_WIN32)
+	counter->thread = GetCurrentThread();
+	counter->name = "thread_cycles";
+#elif defined(__linux__)
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	counter->fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (counter->fd >= 0)
+	{
+		counter->name = "instructions";
+	}
+#endif
+}
+
+inline u8 WorkCounterAvailable(const WorkCounter* counter)
+{
+	return strcmp(counter->name, "none") != 0;
+}
+
+/* Thread cycles always count, only the perf counter has to be switched on and off. */
+inline void StartWorkCounter(WorkCounter* counter)
+{
+#if defined(__linux__)
+	if (counter->fd >= 0)
+	{
+		ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#else
+	(void)counter;
+#endif
+}
+
+inline void StopWorkCounter(WorkCounter* counter)
+{
+#if defined(__linux__)
+	if (counter->fd >= 0)
+	{
+		ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+#else
+	(void)counter;
+#endif
+}
+
+/* Returns -1 if there is no counter. */
+inline i64 ReadWorkCounter(WorkCounter* counter)
+{
+#if defined(_WIN32)
+	ULONG64 cycles;
+	if (counter->thread && QueryThreadCycleTime(counter->thread, &cycles))
+	{
+		return (i64)cycles;
+	}
+#elif defined(__linux__)
+	u64 value;
+	if (counter->fd >= 0 && read(counter->fd, &value, sizeof(value)) == sizeof(value))
+	{
+		return (i64)value;
+	}
+#else
+	(void)counter;
+#endif
+	return -1;
+}
+
+inline void CloseWorkCounter(WorkCounter* counter)
+{
+#if defined(__linux__)
+	if (counter->fd >= 0)
+	{
+		close(counter->fd);
+	}
+	counter->fd = -1;
+#endif
+	counter->name = "none";
+}
+
+/* SCENARIOS */
+
+struct Scenario
+{
+	const char* name;
+	/* Multiple of PERF_FRAMES_PER_SAMPLE. */
+	u32 num_frames;
+	void (*setup)(Game* game);
+	/* Runs before every frame, it's part of the measured batch so keep it cheap.
+	 * Scripts the input and keeps the workload steady, e.g. by not letting the game end. */
+	void (*script)(Game* game, u32 frame, Engine::PlayerInput* keys);
+};
+
+/* The players never run out of lives, so every scenario runs for all of its frames. */
+inline void KeepPlaying(Game* game)
+{
+	game->game_state.game_over = 0;
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
+		game->game_state.players[p].health = PLAYER_START_HEALTH;
+	}
+}
+
+/* Sweeps the players from one side of the canvas to the other. */
+inline void SweepPlayers(u32 frame, Engine::PlayerInput* keys)
+{
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
+		u8 going_right = ((frame + p * 60) / 180) & 0x01;
+		keys[p].left = !going_right;
+		keys[p].right = going_right;
+	}
+}
+
+void NoSetup(Game*) {}
+
+/* Plays the first PERF_OPENING_FRAMES frames of the game over and over. */
+inline void ReplayOpening(Game* game, u32 frame)
+{
+	if (!(frame % PERF_OPENING_FRAMES))
+	{
+		ResetGame(game, PERF_RNG_SEED);
+	}
+	KeepPlaying(game);
+}
+
+/* The untouched formations marching from the top, the player doesn't shoot. */
+void FullFormationOpeningScript(Game* game, u32 frame, Engine::PlayerInput* keys)
+{
+	ReplayOpening(game, frame);
+	SweepPlayers(frame, keys);
+}
+
+/* The opening, with every bomb slot kept alive, raining over the whole width of the canvas. */
+void BombBarrageScript(Game* game, u32 frame, Engine::PlayerInput* keys)
+{
+	ReplayOpening(game, frame);
+	SweepPlayers(frame, keys);
+
+	for (u8 i = 0; i < game_constants::max_num_bombs; ++i)
+	{
+		ParticleAttributes* attributes = &game->bomb_system.attributes[i];
+		if (!attributes->alive || attributes->pos_y > Engine::CanvasHeight)
+		{
+			attributes->alive = 1;
+			attributes->pos_x = (pixel_t)(xorshift32() % Engine::CanvasWidth);
+			attributes->pos_y = (pos_t)(xorshift32() % (Engine::CanvasHeight / 2));
+		}
+	}
+}
+
+/* Every rocket slot is kept alive, fired from all over the canvas. */
+void RocketSpamScript(Game* game, u32, Engine::PlayerInput* keys)
+{
+	KeepPlaying(game);
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
+		keys[p].fire = 1;
+		for (u8 i = 0; i < game_constants::max_num_rockets; ++i)
+		{
+			/* AddRocket writes to the next slot of the ring, not to the dead one. */
+			ParticleAttributes* attributes = &game->rocket_systems[p].attributes[i];
+			if (!attributes->alive)
+			{
+				attributes->alive = 1;
+				attributes->pos_x = (pixel_t)(xorshift32() % Engine::CanvasWidth);
+				attributes->pos_y = game_constants::rocket_start_y;
+			}
+		}
+	}
+}
+
+/* Formations are held right above the players, where everything collides. */
+static const pos_t late_game_formation_y =
+    (pos_t)(game_constants::player_position_y - ALIEN_FORMATION_NUM_ROWS * Engine::SpriteSize -
+            (ALIEN_FORMATION_NUM_ROWS - 1) * ALIEN_FORMATION_INNER_PADDING_Y);
+
+void LateGameSetup(Game* game)
+{
+	for (u8 f = 0; f < game_constants::max_num_alien_formations; ++f)
+	{
+		game->alien_formations.pos_y[f] = late_game_formation_y;
+	}
+}
+
+void LateGameScript(Game* game, u32 frame, Engine::PlayerInput* keys)
+{
+	KeepPlaying(game);
+	/* Alternate moving and shooting, the input handling only takes one of them. */
+	SweepPlayers(frame, keys);
+	if (frame & 0x01)
+	{
+		for (u8 p = 0; p < NUM_PLAYERS; ++p)
+		{
+			keys[p].left = 0;
+			keys[p].right = 0;
+			keys[p].fire = 1;
+		}
+	}
+	/* Pull the formations that jumped down or just spawned back to the bottom. */
+	LateGameSetup(game);
+}
+
+static const Scenario scenarios[] = {
+    {"full_formation_opening", 12000, NoSetup, FullFormationOpeningScript},
+    {"bomb_barrage", 12000, NoSetup, BombBarrageScript},
+    {"rocket_spam", 12000, NoSetup, RocketSpamScript},
+    {"late_game", 72000, LateGameSetup, LateGameScript},
+};
+static const u32 num_scenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+
+/* MEASUREMENTS */
+
+struct ScenarioResult
+{
+	float fps;
+	/* 99th percentile of the single frame times. */
+	float p99_ms;
+	/* -1 if there's no work counter. */
+	i64 counter_per_frame;
+	/* Sprites drawn over the measured frames, tells if two runs did the same work. */
+	u64 num_sprites;
+};
+
+struct BaselineEntry
+{
+	char name[64];
+	ScenarioResult result;
+	float fps_tolerance;
+	float p99_tolerance;
+	/* Name of the work counter the baseline was recorded with. */
+	char counter[32];
+	float counter_tolerance;
+};
+
+ScenarioResult RunScenario(const Scenario* scenario, WorkCounter* counter)
+{
+	Game game;
+	ALLOC_GAME_ON_STACK(game)
+	ResetGame(&game, PERF_RNG_SEED);
+	scenario->setup(&game);
+
+	HeadlessRenderer renderer;
+	/* Every frame is timed on its own with the time stamp counter, which is cheap enough
+	 * to read around a single frame. The ticks are turned into seconds with the rate the
+	 * counter ran at next to the clock over the batches. */
+	std::vector<u64> frame_ticks;
+	frame_ticks.reserve(scenario->num_frames);
+	double total_time = 0.0;
+	u64 total_ticks = 0;
+	i64 total_count = 0;
+	double timestamp = 0.0;
+	u32 frame = 0;
+
+	for (; frame < PERF_WARMUP_FRAMES; ++frame)
+	{
+		Engine::PlayerInput keys[NUM_PLAYERS];
+		memset(keys, 0, sizeof(keys));
+		scenario->script(&game, frame, keys);
+		timestamp += PERF_TIMESTEP;
+		GameFrame(&game, &renderer, keys, timestamp, PERF_TIMESTEP);
+	}
+	renderer.num_sprites = 0;
+
+	for (u32 sample = 0; sample < scenario->num_frames / PERF_FRAMES_PER_SAMPLE; ++sample)
+	{
+		i64 count_before = ReadWorkCounter(counter);
+		StartWorkCounter(counter);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		u64 sample_start_ticks = __rdtsc();
+
+		for (u32 sample_end = frame + PERF_FRAMES_PER_SAMPLE; frame < sample_end; ++frame)
+		{
+			u64 frame_start_ticks = __rdtsc();
+			Engine::PlayerInput keys[NUM_PLAYERS];
+			memset(keys, 0, sizeof(keys));
+			scenario->script(&game, frame, keys);
+			timestamp += PERF_TIMESTEP;
+			GameFrame(&game, &renderer, keys, timestamp, PERF_TIMESTEP);
+			frame_ticks.push_back(__rdtsc() - frame_start_ticks);
+		}
+
+		total_ticks += __rdtsc() - sample_start_ticks;
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		StopWorkCounter(counter);
+		total_count += ReadWorkCounter(counter) - count_before;
+
+		total_time += std::chrono::duration<double>(end - start).count();
+	}
+
+	std::sort(frame_ticks.begin(), frame_ticks.end());
+	double seconds_per_tick = total_time / (double)total_ticks;
+	ScenarioResult result;
+	result.fps = (float)(scenario->num_frames / total_time);
+	result.p99_ms = (float)(frame_ticks[(size_t)(frame_ticks.size() * 0.99)] *
+	                        seconds_per_tick * 1000.0);
+	result.counter_per_frame =
+	    WorkCounterAvailable(counter) ? total_count / scenario->num_frames : -1;
+	result.num_sprites = renderer.num_sprites;
+	return result;
+}
+
+/* Baseline format, one scenario per line, # starts a comment:
+ * name fps p99_ms counter counter_per_frame fps_tolerance p99_tolerance counter_tolerance */
+u32 ReadBaseline(const char* path, BaselineEntry* entries, u32 max_entries)
+{
+	FILE* file;
+	if (fopen_s(&file, path, "r") || !file)
+	{
+		return 0;
+	}
+	u32 num_entries = 0;
+	char line[256];
+	while (num_entries < max_entries && fgets(line, sizeof(line), file))
+	{
+		if (line[0] == '#' || line[0] == '\n')
+		{
+			continue;
+		}
+		BaselineEntry* entry = &entries[num_entries];
+		long long count;
+		if (sscanf_s(line,
+		             "%63s %f %f %31s %lld %f %f %f",
+		             entry->name,
+		             (unsigned)sizeof(entry->name),
+		             &entry->result.fps,
+		             &entry->result.p99_ms,
+		             entry->counter,
+		             (unsigned)sizeof(entry->counter),
+		             &count,
+		             &entry->fps_tolerance,
+		             &entry->p99_tolerance,
+		             &entry->counter_tolerance) == 8)
+		{
+			entry->result.counter_per_frame = count;
+			num_entries++;
+		}
+	}
+	fclose(file);
+	return num_entries;
+}
+
+u8 WriteBaseline(const char* path, const ScenarioResult* results, const WorkCounter* counter)
+{
+	FILE* file;
+	if (fopen_s(&file, path, "w") || !file)
+	{
+		return 0;
+	}
+	fprintf(file,
+	        "# Frame budget baseline, written by PerfRegression --write-baseline.\n"
+	        "# Only comparable on the machine and build configuration it was recorded with.\n"
+	        "# counter_per_frame is -1 where no work counter was available.\n"
+	        "# name fps p99_ms counter counter_per_frame fps_tolerance p99_tolerance "
+	        "counter_tolerance\n");
+	for (u32 i = 0; i < num_scenarios; ++i)
+	{
+		fprintf(file,
+		        "%s %.0f %.6f %s %lld %.2f %.2f %.2f\n",
+		        scenarios[i].name,
+		        results[i].fps,
+		        results[i].p99_ms,
+		        counter->name,
+		        (long long)results[i].counter_per_frame,
+		        PERF_DEFAULT_FPS_TOLERANCE,
+		        PERF_DEFAULT_P99_TOLERANCE,
+		        PERF_DEFAULT_COUNTER_TOLERANCE);
+	}
+	fclose(file);
+	return 1;
+}
+
+/* Prints the comparison of a scenario against its baseline, returns 1 if it regressed. */
+u8 CompareAgainstBaseline(const ScenarioResult* result,
+                          const BaselineEntry* baseline,
+                          const WorkCounter* counter)
+{
+	const ScenarioResult* expected = &baseline->result;
+	u8 fps_regressed = result->fps < expected->fps * (1.0f - baseline->fps_tolerance);
+	u8 p99_regressed = result->p99_ms > expected->p99_ms * (1.0f + baseline->p99_tolerance);
+	/* Counts are only compared when both runs read the same counter. */
+	u8 counter_regressed =
+	    result->counter_per_frame >= 0 && expected->counter_per_frame >= 0 &&
+	    !strcmp(counter->name, baseline->counter) &&
+	    result->counter_per_frame >
+	        expected->counter_per_frame * (1.0f + baseline->counter_tolerance);
+
+	printf("  fps          %10.0f  baseline %10.0f  %s\n",
+	       result->fps,
+	       expected->fps,
+	       fps_regressed ? "REGRESSED" : "ok");
+	printf("  p99 ms       %10.4f  baseline %10.4f  %s\n",
+	       result->p99_ms,
+	       expected->p99_ms,
+	       p99_regressed ? "REGRESSED" : "ok");
+	printf("  %-13s%10lld  baseline %10lld  %s\n",
+	       counter->name,
+	       (long long)result->counter_per_frame,
+	       (long long)expected->counter_per_frame,
+	       counter_regressed ? "REGRESSED" : "ok");
+	return fps_regressed | p99_regressed | counter_regressed;
+}
+
+int main(int argc, char** argv)
+{
+	const char* baseline_path = PERF_BASELINE_PATH;
+	u8 write_baseline = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--write-baseline"))
+		{
+			write_baseline = 1;
+		}
+		else
+		{
+			baseline_path = argv[i];
+		}
+	}
+
+	WorkCounter counter;
+	OpenWorkCounter(&counter);
+	if (!WorkCounterAvailable(&counter))
+	{
+		printf("No work counter is available, only timings will be compared.\n");
+	}
+
+	ScenarioResult results[num_scenarios];
+	for (u32 i = 0; i < num_scenarios; ++i)
+	{
+		results[i] = RunScenario(&scenarios[i], &counter);
+		for (u32 r = 1; r < PERF_REPETITIONS; ++r)
+		{
+			ScenarioResult result = RunScenario(&scenarios[i], &counter);
+			/* Best of the runs only makes sense if they all did the same work. */
+			if (result.num_sprites != results[i].num_sprites)
+			{
+				printf("%s doesn't replay the same workload on every run.\n", scenarios[i].name);
+				return PERF_EXIT_REGRESSED;
+			}
+			results[i].fps = std::max(results[i].fps, result.fps);
+			results[i].p99_ms = std::min(results[i].p99_ms, result.p99_ms);
+			results[i].counter_per_frame =
+			    std::min(results[i].counter_per_frame, result.counter_per_frame);
+		}
+	}
+	CloseWorkCounter(&counter);
+
+	if (write_baseline)
+	{
+		if (!WriteBaseline(baseline_path, results, &counter))
+		{
+			printf("Couldn't write the baseline to %s.\n", baseline_path);
+			return PERF_EXIT_REGRESSED;
+		}
+		printf("Baseline written to %s.\n", baseline_path);
+		return PERF_EXIT_PASSED;
+	}
+
+	BaselineEntry baseline[16];
+	u32 num_baseline_entries = ReadBaseline(baseline_path, baseline, 16);
+
+	u8 regressed = 0;
+	u8 missing_baseline = 0;
+	for (u32 i = 0; i < num_scenarios; ++i)
+	{
+		printf("%s (%u frames, %llu sprites/frame)\n",
+		       scenarios[i].name,
+		       scenarios[i].num_frames,
+		       (unsigned long long)(results[i].num_sprites / scenarios[i].num_frames));
+
+		const BaselineEntry* entry = NULL;
+		for (u32 j = 0; j < num_baseline_entries; ++j)
+		{
+			if (!strcmp(baseline[j].name, scenarios[i].name))
+			{
+				entry = &baseline[j];
+				break;
+			}
+		}
+		if (!entry)
+		{
+			printf("  no baseline in %s, run with --write-baseline to record one\n",
+			       baseline_path);
+			missing_baseline = 1;
+			continue;
+		}
+		regressed |= CompareAgainstBaseline(&results[i], entry, &counter);
+	}
+
+	if (regressed)
+	{
+		printf("FAILED: frame budget regressed.\n");
+		return PERF_EXIT_REGRESSED;
+	}
+	if (missing_baseline)
+	{
+		printf("NO BASELINE: record one on the release machine with --write-baseline.\n");
+		return PERF_EXIT_NO_BASELINE;
+	}
+	printf("PASSED\n");
+	return PERF_EXIT_PASSED;
+}
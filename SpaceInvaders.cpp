@@ -8,6 +8,12 @@
 #include <string.h>
 
 #include "Config.h"
+#if (FRAME_CAPTURE)
+#include "FrameCapture.h"
+#endif
+#if (LOCKSTEP_MODE)
+#include "Lockstep.h"
+#endif
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -44,17 +50,40 @@ static const float rocket_firing_cooldown =
     (float)Engine::CanvasHeight / ((float)max_num_rockets * ROCKET_MOVE_SPEED_PX_PER_SEC);
 static const pos_t rocket_start_y =
     (pos_t)game_constants::player_position_y - ((pos_t)Engine::SpriteSize * 0.5f);
-static const pos_t player_initial_position_x = (Engine::CanvasWidth - Engine::SpriteSize) * 0.5;
+/* Players are spread evenly over the bottom of the canvas. */
+static const pos_t player_spacing_x = (pos_t)Engine::CanvasWidth / NUM_PLAYERS;
+static const pixel_t alien_formation_width =
+    ALIEN_FORMATION_NUM_COLS * (Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_X) -
+    ALIEN_FORMATION_INNER_PADDING_X;
+static const pixel_t alien_formation_height =
+    ALIEN_FORMATION_NUM_ROWS * (Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_Y) -
+    ALIEN_FORMATION_INNER_PADDING_Y;
+static const u8 max_num_alien_formations = ALIEN_NUM_TYPES * ALIEN_NUM_CONCURRENT_FORMATIONS;
 }; // namespace game_constants
 
+inline pos_t PlayerInitialPositionX(u8 player)
+{
+	return game_constants::player_spacing_x * ((pos_t)player + 0.5f) - Engine::SpriteSize * 0.5f;
+}
+
+/* State of the XorShift below, set by SeedRandom so a game can be replayed exactly. */
+static u32 xorshift_state = 1;
+
+/* XorShift gets stuck at 0, so a zero seed is bumped to 1. */
+inline void SeedRandom(u32 seed)
+{
+	xorshift_state = seed + !seed;
+}
+
 /* XorShift with 32 bit state word, taken from Wikipedia. */
 u32 xorshift32()
 {
 	/* Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" */
-	static u32 x = rand();
+	u32 x = xorshift_state;
 	x ^= x << 13;
 	x ^= x >> 17;
 	x ^= x << 5;
+	xorshift_state = x;
 	return x;
 }
 
@@ -97,99 +126,171 @@ inline void AddBomb(ParticleSystem* bomb_system, pixel_t bomb_x, pixel_t bomb_y)
 	attributes->pos_y = (pos_t)bomb_y;
 }
 
-struct AlienSystem
+/* Archetype storage for all the alien formations alive at the same time.
+ * Every attribute lives in its own array (SoA) and formations of the same type occupy
+ * a contiguous block of slots, so the main loop processes each type in a tight loop
+ * with a constant sprite. Type t owns the slots starting at
+ * t * ALIEN_NUM_CONCURRENT_FORMATIONS, count[t] of which are in use. */
+struct AlienFormations
 {
-	/* Position of the AlienSystem corresponds to top left of the grid. */
-	pos_t pos_x = 0;
-	pos_t pos_y = 0;
+	u8 count[ALIEN_NUM_TYPES] = {};
+	/* Formations waiting for a free spawn position. */
+	u8 num_pending = 0;
+	/* Index of the next predetermined formation/type. */
+	u8 predetermined_formation = 0;
+
+	/* Position of a formation corresponds to top left of its grid. */
+	pos_t* pos_x = NULL;
+	pos_t* pos_y = NULL;
+	float* speed = NULL;
+	i8* direction = NULL;
+	/* ALIEN_FORMATION_NUM_ROWS consecutive row masks per slot. */
 	ALIEN_MASK_T* aliens_mask = NULL;
-	Engine::Sprite alien_sprite;
-
-	u16 _width = 0;
-#if (0)
-	u16 _height = 0;
-#endif
-	i8 _direction = 1;
 };
 
-inline void ResetAlienSystem(AlienSystem* alien_system)
+/* Whether a formation placed at (x, y) would overlap any of the live formations.
+ * Formations are treated as their full grid, regardless of which aliens are still alive. */
+inline bool AlienFormationOverlaps(const AlienFormations* alien_formations, pos_t x, pos_t y)
 {
-	alien_system->pos_x = ALIEN_INITIAL_POS_X;
-	alien_system->pos_y = ALIEN_INITIAL_POS_Y;
-	alien_system->_direction = ALIEN_INITIAL_DIRECTION;
-	alien_system->_width =
-	    ALIEN_FORMATION_NUM_COLS * (Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_X) -
-	    ALIEN_FORMATION_INNER_PADDING_X;
-#if (0)
-	alien_system->_height =
-	    ALIEN_FORMATION_NUM_ROWS * (Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_Y) -
-	    ALIEN_FORMATION_INNER_PADDING_Y;
-#endif
-	ZERO_MEM(alien_system->aliens_mask, ALIEN_FORMATION_NUM_ROWS * sizeof(ALIEN_MASK_T));
+	bool overlaps = false;
+	for (u8 t = 0; t < ALIEN_NUM_TYPES; ++t)
+	{
+		const u8 first = t * ALIEN_NUM_CONCURRENT_FORMATIONS;
+		for (u8 f = first; f < first + alien_formations->count[t]; ++f)
+		{
+			overlaps |= fabsf(alien_formations->pos_x[f] - x) <
+			                (pos_t)(game_constants::alien_formation_width +
+			                        ALIEN_FORMATION_INNER_PADDING_X) &&
+			            fabsf(alien_formations->pos_y[f] - y) <
+			                (pos_t)(game_constants::alien_formation_height +
+			                        ALIEN_FORMATION_INNER_PADDING_Y);
+		}
+	}
+	return overlaps;
+}
 
+/* Spawns the next formation, entering from its own side of the screen, or from the
+ * opposite side if that one is taken by a live formation.
+ * Returns false and consumes nothing if both spawn positions are taken. */
+inline bool TrySpawnAlienFormation(AlienFormations* alien_formations)
+{
 	/* Since we're storing each row in a word of length equal to the next power of 2,
 	 * we need to mask the unused bits. */
 	const ALIEN_MASK_T col_mask = (ALIEN_MASK_T)(((u32)1 << ALIEN_FORMATION_NUM_COLS) - 1);
 
 #if (!ALIEN_RANDOM_FORMATION || !ALIEN_RANDOM_ENEMY_TYPE)
-	/* If we're randoming either formation or the type of the aliens,
-	 * we need a counter to pick the next predetermined formation/type. */
-	static u8 predetermined_formation = 0;
+	/* If we're not randoming either formation or the type of the aliens,
+	 * this is the next predetermined formation/type. */
+	const u8 predetermined_formation = alien_formations->predetermined_formation;
 #endif
 
 #if (ALIEN_RANDOM_FORMATION)
-	for (int i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
-	{
-		u32 r = xorshift32();
-		alien_system->aliens_mask[i] = (ALIEN_MASK_T)r & col_mask;
-	}
+	const float speed = ALIENS_SPEED_PX_PER_SEC;
+	i8 direction = ALIEN_INITIAL_DIRECTION;
 #else
-	for (int i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
+	const float speed = ALIEN_PREDETERMINED_SPEED[predetermined_formation];
+	i8 direction = ALIEN_PREDETERMINED_DIRECTION[predetermined_formation];
+#endif
+
+	const pos_t left_x = ALIEN_INITIAL_POS_X;
+	const pos_t right_x =
+	    Engine::CanvasWidth - game_constants::alien_formation_width - ALIEN_INITIAL_POS_X;
+	const pos_t pos_y = ALIEN_INITIAL_POS_Y;
+
+	if (AlienFormationOverlaps(alien_formations, direction > 0 ? left_x : right_x, pos_y))
 	{
-		alien_system->aliens_mask[i] =
-		    ALIEN_PREDETERMINED_FORMATIONS[predetermined_formation][i] & col_mask;
+		if (AlienFormationOverlaps(alien_formations, direction > 0 ? right_x : left_x, pos_y))
+		{
+			return false;
+		}
+		direction = -direction;
 	}
-#endif
 
 #if (ALIEN_RANDOM_ENEMY_TYPE)
-	/* If random enemy type flag is set, pick Enemy1 or Enemy2 by 50/50 chance. */
-	float r = UnitRandom();
-	if (r < 0.5f)
+	/* If random enemy type flag is set, pick any of the types with equal chance. */
+	u8 alien_type = (u8)(UnitRandom() * ALIEN_NUM_TYPES);
+	alien_type -= (alien_type == ALIEN_NUM_TYPES);
+#else
+	/* If random enemy type flag is unset, set the enemy type to the next predetermined one. */
+	u8 alien_type = ALIEN_PREDETERMINED_TYPE[predetermined_formation];
+#endif
+
+	/* At most ALIEN_NUM_CONCURRENT_FORMATIONS formations are alive at once,
+	 * so a single type can never run out of slots. */
+	const u8 slot =
+	    alien_type * ALIEN_NUM_CONCURRENT_FORMATIONS + alien_formations->count[alien_type]++;
+
+	alien_formations->speed[slot] = speed;
+	alien_formations->direction[slot] = direction;
+	alien_formations->pos_x[slot] = direction > 0 ? left_x : right_x;
+	alien_formations->pos_y[slot] = pos_y;
+
+	ALIEN_MASK_T* aliens_mask = &alien_formations->aliens_mask[slot * ALIEN_FORMATION_NUM_ROWS];
+
+#if (ALIEN_RANDOM_FORMATION)
+	for (int i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
 	{
-		alien_system->alien_sprite = Engine::Sprite::Enemy1;
+		u32 r = xorshift32();
+		aliens_mask[i] = (ALIEN_MASK_T)r & col_mask;
 	}
-	else
+#else
+	for (int i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
 	{
-		alien_system->alien_sprite = Engine::Sprite::Enemy2;
+		aliens_mask[i] = ALIEN_PREDETERMINED_FORMATIONS[predetermined_formation][i] & col_mask;
 	}
-#else
-	/* If random enemy type flag is unset, set the enemy type to the next predetermined one. */
-	alien_system->alien_sprite = ALIEN_PREDETERMINED_TYPE[predetermined_formation];
 #endif
 
 #if (!ALIEN_RANDOM_FORMATION || !ALIEN_RANDOM_ENEMY_TYPE)
-	predetermined_formation++;
 	/* If the define is a power of 2, compiler should optimize this division into a simple and. */
-	predetermined_formation %= ALIEN_NUM_PREDETERMINED_FORMATIONS;
+	alien_formations->predetermined_formation =
+	    (predetermined_formation + 1) % ALIEN_NUM_PREDETERMINED_FORMATIONS;
 #endif
+	return true;
+}
+
+/* Spawns as many of the pending formations as there are free spawn positions for,
+ * the rest wait until the formations in the way move on. */
+inline void SpawnPendingAlienFormations(AlienFormations* alien_formations)
+{
+	for (; alien_formations->num_pending && TrySpawnAlienFormation(alien_formations);)
+	{
+		alien_formations->num_pending--;
+	}
+}
+
+/* Removes the formation in the given slot by moving the last formation of the same type
+ * into its place, so the slots of every type stay contiguous. */
+inline void RemoveAlienFormation(AlienFormations* alien_formations, u8 alien_type, u8 slot)
+{
+	const u8 last =
+	    alien_type * ALIEN_NUM_CONCURRENT_FORMATIONS + --alien_formations->count[alien_type];
+
+	alien_formations->pos_x[slot] = alien_formations->pos_x[last];
+	alien_formations->pos_y[slot] = alien_formations->pos_y[last];
+	alien_formations->speed[slot] = alien_formations->speed[last];
+	alien_formations->direction[slot] = alien_formations->direction[last];
+	memcpy(&alien_formations->aliens_mask[slot * ALIEN_FORMATION_NUM_ROWS],
+	       &alien_formations->aliens_mask[last * ALIEN_FORMATION_NUM_ROWS],
+	       ALIEN_FORMATION_NUM_ROWS * sizeof(ALIEN_MASK_T));
 }
 
-/* This function moves the alien system on the canvas. It doesn't contain any loops,
+/* This function moves a single alien formation on the canvas. It doesn't contain any loops,
  * rather, it takes the cumulative or of the row masks from the main loop as input
  * to calculate leftmost and rightmost set bits (leftmost and rightmost existing aliens). */
-void MoveAlienSystem(AlienSystem* alien_system, ALIEN_MASK_T cor, float dt)
+void MoveAlienFormation(AlienFormations* alien_formations, u8 slot, ALIEN_MASK_T cor, float dt)
 {
 	{
-		/* Update the position of the alien system. */
-		alien_system->pos_x += dt * ALIENS_SPEED_PX_PER_SEC * alien_system->_direction;
+		/* Update the position of the formation. */
+		alien_formations->pos_x[slot] +=
+		    dt * alien_formations->speed[slot] * alien_formations->direction[slot];
 	}
 
 	{
 		/* If pos_x < 0:
 		 *   check if the leftmost alien touches the border.
-		 * If pos_x > CanvasWidth - AlienSystemWidth:
+		 * If pos_x > CanvasWidth - FormationWidth:
 		 *   check if the rightmost alien touches the border. */
-		const pos_t pos_x = alien_system->pos_x;
+		const pos_t pos_x = alien_formations->pos_x[slot];
 
 		if (pos_x < 0)
 		{
@@ -202,14 +303,14 @@ void MoveAlienSystem(AlienSystem* alien_system, ALIEN_MASK_T cor, float dt)
 
 			if (pos_x < margin)
 			{
-				alien_system->pos_y += ALIENS_Y_JUMP_PX;
-				alien_system->_direction = 1;
-				alien_system->pos_x = (pos_t)margin + ALIEN_BORDER_CORRECTION_MARGIN;
+				alien_formations->pos_y[slot] += ALIENS_Y_JUMP_PX;
+				alien_formations->direction[slot] = 1;
+				alien_formations->pos_x[slot] = (pos_t)margin + ALIEN_BORDER_CORRECTION_MARGIN;
 			}
 		}
 		else
 		{
-			pixel_t margin = Engine::CanvasWidth - alien_system->_width;
+			pixel_t margin = Engine::CanvasWidth - game_constants::alien_formation_width;
 			if (pos_x > margin)
 			{
 				unsigned long rightmost_alien;
@@ -220,9 +321,9 @@ void MoveAlienSystem(AlienSystem* alien_system, ALIEN_MASK_T cor, float dt)
 				          (Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_X);
 				if (pos_x > margin)
 				{
-					alien_system->pos_y += ALIENS_Y_JUMP_PX;
-					alien_system->_direction = -1;
-					alien_system->pos_x = (pos_t)margin - ALIEN_BORDER_CORRECTION_MARGIN;
+					alien_formations->pos_y[slot] += ALIENS_Y_JUMP_PX;
+					alien_formations->direction[slot] = -1;
+					alien_formations->pos_x[slot] = (pos_t)margin - ALIEN_BORDER_CORRECTION_MARGIN;
 				}
 			}
 		}
@@ -242,14 +343,12 @@ inline u8 CollisionTest(pixel_t x1,
 	return (xdif <= x_threshold) & (ydif <= y_threshold);
 }
 
-struct GameState
+struct PlayerState
 {
-	u64 bombs_dropped : 16;
 	u64 rockets_fired : 16;
 	u64 aliens_killed : 16;
 
-	u64 game_over : 4;
-	u64 player_health : 6;
+	u64 health : 6;
 
 	/* Player temporarily becomes a ghost after dying and respawning.
 	 * In the ghost state, player is invincible yet it still
@@ -257,184 +356,225 @@ struct GameState
 	 * Player knows he is in the ghost state because the sprite blinks.
 	 * 0 if player is not in the ghost state,
 	 * == blink counter + 1 if it is.*/
-	u64 player_ghost : 6;
+	u64 ghost : 6;
 
-	pos_t player_position_x;
+	pos_t position_x;
 	/* Time since the player entered into the ghost state. */
-	float player_ghost_timer;
+	float ghost_timer;
 	/* The timestamp last rocket was fired at. */
 	double rocket_last_fired;
 };
 
-inline void PlayerKilled(GameState* game_state)
+struct GameState
 {
-	game_state->player_health--;
-	game_state->game_over = !game_state->player_health;
-	game_state->player_position_x = game_constants::player_initial_position_x;
-	game_state->player_ghost = 1;
-	game_state->player_ghost_timer = 0.0f;
-}
+	u64 bombs_dropped : 16;
+	u64 game_over : 4;
 
-void EngineMain()
-{
-	Engine engine;
+	/* A single player, or the two players of a lockstep match sharing the same aliens. */
+	PlayerState players[NUM_PLAYERS];
+};
 
-	/* Greeting part. */
-	/* Scopes help get rid of unnecessary character buffers when the game starts
-	 * AND it provides code clarity. */
+inline void PlayerKilled(GameState* game_state, u8 player_index)
+{
+	PlayerState* player = &game_state->players[player_index];
+	player->health--;
+	player->position_x = PlayerInitialPositionX(player_index);
+	player->ghost = 1;
+	player->ghost_timer = 0.0f;
+
+	/* The game is over once nobody is left. */
+	u8 players_alive = 0;
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
 	{
-		/* Display greeting message, controls scheme and optionally, the configuration message. */
-		const char greeting_message[] = "Good Luck!";
-		pixel_wide_t greeting_text_x =
-		    (Engine::CanvasWidth - (sizeof(greeting_message) - 1) * Engine::FontWidth) / 2;
-		pixel_wide_t greeting_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2 - 150;
-
-		char controls_text[128];
-		sprintf_s(controls_text, "Controls: Left Arrow, Right Arrow, Space.");
-		pixel_wide_t controls_text_x =
-		    (Engine::CanvasWidth - (strlen(controls_text) - 1) * Engine::FontWidth) / 2;
-		pixel_wide_t controls_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2 - 50;
-
-#if (DISPLAY_CONFIGURATION)
-		char config_text[160];
-		sprintf_s(config_text,
-		          "Lives: %d\nRandom Formation: %d\nRandom Enemy: %d\nPlayer SPD: %.0f\n"
-		          "Alien SPD: %.0f\nRocket SPD: %.0f\nBomb SPD: %.0f\n"
-		          "Bomb Chance (/Alien/Sec): %.2f",
-		          PLAYER_START_HEALTH,
-		          ALIEN_RANDOM_FORMATION,
-		          ALIEN_RANDOM_ENEMY_TYPE,
-		          PLAYER_MOVE_SPEED_PX_PER_SEC,
-		          ALIENS_SPEED_PX_PER_SEC,
-		          ROCKET_MOVE_SPEED_PX_PER_SEC,
-		          BOMB_MOVE_SPEED_PX_PER_SEC,
-		          ALIEN_BOMB_DROP_CHANCE_EACH_SEC);
-		pixel_wide_t config_text_x =
-		    (Engine::CanvasWidth - (strlen(config_text) - 1) / 6 * Engine::FontWidth) / 2;
-		pixel_wide_t config_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2;
-#endif
-
-		while (true)
-		{
-			bool keep_going = engine.startFrame();
-			if (!keep_going)
-			{
-				/* If the player hits the ESC key or closes the window, exit the game. */
-				return;
-			}
-			Engine::PlayerInput keys = engine.getPlayerInput();
-			if (keys.left || keys.right || keys.fire)
-			{
-				/* Start the actual game when player gives an input. */
-				break;
-			}
-			engine.drawText(greeting_message, greeting_text_x, greeting_text_y);
-			engine.drawText(controls_text, controls_text_x, controls_text_y);
-#if (DISPLAY_CONFIGURATION)
-			engine.drawText(config_text, config_text_x, config_text_y);
-#endif
-		}
+		players_alive |= (game_state->players[p].health != 0);
 	}
+	game_state->game_over |= !players_alive;
+}
 
-	/* The actual game. */
+/* Everything the game simulates. */
+struct Game
+{
+	GameState game_state;
+	/* Every player has its own rockets, so that the kills can be credited. */
+	ParticleSystem rocket_systems[NUM_PLAYERS];
+	ParticleSystem bomb_system;
+	AlienFormations alien_formations;
+};
 
-	/* Set up game systems. */
+/* The arrays of the game systems live on the stack of the function running the game,
+ * which is why this is a macro rather than a function. */
+#define ALLOC_GAME_ON_STACK(GAME)                                                              \
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)                                                       \
+	{                                                                                          \
+		(GAME).rocket_systems[p].attributes =                                                  \
+		    ALLOC_ON_STACK(ParticleAttributes, game_constants::max_num_rockets);               \
+	}                                                                                          \
+	(GAME).bomb_system.attributes =                                                            \
+	    ALLOC_ON_STACK(ParticleAttributes, game_constants::max_num_bombs);                     \
+	(GAME).alien_formations.pos_x =                                                            \
+	    ALLOC_ON_STACK(pos_t, game_constants::max_num_alien_formations);                       \
+	(GAME).alien_formations.pos_y =                                                            \
+	    ALLOC_ON_STACK(pos_t, game_constants::max_num_alien_formations);                       \
+	(GAME).alien_formations.speed =                                                            \
+	    ALLOC_ON_STACK(float, game_constants::max_num_alien_formations);                       \
+	(GAME).alien_formations.direction =                                                        \
+	    ALLOC_ON_STACK(i8, game_constants::max_num_alien_formations);                          \
+	(GAME).alien_formations.aliens_mask = ALLOC_ON_STACK(                                      \
+	    ALIEN_MASK_T, game_constants::max_num_alien_formations * ALIEN_FORMATION_NUM_ROWS);
+
+/* Sets up a new game on the arrays allocated by ALLOC_GAME_ON_STACK. */
+/* Same seed, same inputs and same time steps always play out the same game. */
+void ResetGame(Game* game, u32 seed)
+{
+	SeedRandom(seed);
 
-	GameState game_state;
-	memset(&game_state, 0x00, sizeof(GameState));
-	game_state.player_health = PLAYER_START_HEALTH;
-	game_state.player_position_x = game_constants::player_initial_position_x;
+	GameState* game_state = &game->game_state;
+	memset(game_state, 0x00, sizeof(GameState));
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
+		game_state->players[p].health = PLAYER_START_HEALTH;
+		game_state->players[p].position_x = PlayerInitialPositionX(p);
 
-	ParticleSystem rocket_system;
-	rocket_system.attributes = ALLOC_ON_STACK(ParticleAttributes, game_constants::max_num_rockets);
-	ZERO_MEM(rocket_system.attributes, game_constants::max_num_rockets * sizeof(ParticleAttributes))
+		game->rocket_systems[p].num_particles = 0;
+		ZERO_MEM(game->rocket_systems[p].attributes,
+		         game_constants::max_num_rockets * sizeof(ParticleAttributes))
+	}
 
-	ParticleSystem bomb_system;
-	bomb_system.attributes = ALLOC_ON_STACK(ParticleAttributes, game_constants::max_num_bombs);
-	ZERO_MEM(bomb_system.attributes, game_constants::max_num_bombs * sizeof(ParticleAttributes))
+	game->bomb_system.num_particles = 0;
+	ZERO_MEM(game->bomb_system.attributes,
+	         game_constants::max_num_bombs * sizeof(ParticleAttributes))
+
+	AlienFormations* alien_formations = &game->alien_formations;
+	memset(alien_formations->count, 0, sizeof(alien_formations->count));
+	alien_formations->num_pending = ALIEN_NUM_CONCURRENT_FORMATIONS;
+	alien_formations->predetermined_formation = 0;
+	ZERO_MEM(alien_formations->aliens_mask,
+	         game_constants::max_num_alien_formations * ALIEN_FORMATION_NUM_ROWS *
+	             sizeof(ALIEN_MASK_T))
+	SpawnPendingAlienFormations(alien_formations);
+}
 
-	AlienSystem alien_system;
-	alien_system.aliens_mask = ALLOC_ON_STACK(ALIEN_MASK_T, ALIEN_FORMATION_NUM_ROWS);
-	ResetAlienSystem(&alien_system);
+#if (LOCKSTEP_MODE)
+/* Hash of everything the simulation depends on, compared between the peers every frame. */
+u32 HashGame(const Game* game)
+{
+	const AlienFormations* alien_formations = &game->alien_formations;
 
-#if (PLAYER_START_HEALTH < 10)
-	/* If start health (max possible health value) is less than 10,
-	 * just put the appropriate character into the string.
-	 * So let's allocate the health text here. */
-	char health_text[] = "Lives left:  ";
-	/* Otherwise we'll use sprintf with a local buffer. */
+	/* GameState is zeroed before use, so its padding hashes the same on both sides. */
+	u32 hash = Fnv1a(fnv1a_offset_basis, &game->game_state, sizeof(GameState));
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
+		hash = Fnv1a(hash,
+		             game->rocket_systems[p].attributes,
+		             game_constants::max_num_rockets * sizeof(ParticleAttributes));
+	}
+	hash = Fnv1a(hash,
+	             game->bomb_system.attributes,
+	             game_constants::max_num_bombs * sizeof(ParticleAttributes));
+	hash = Fnv1a(hash, alien_formations->count, sizeof(alien_formations->count));
+	hash = Fnv1a(hash, &alien_formations->num_pending, sizeof(u8));
+	hash = Fnv1a(hash, &alien_formations->predetermined_formation, sizeof(u8));
+	for (u8 t = 0; t < ALIEN_NUM_TYPES; ++t)
+	{
+		const u8 group_begin = t * ALIEN_NUM_CONCURRENT_FORMATIONS;
+		const u8 group_end = group_begin + alien_formations->count[t];
+		for (u8 f = group_begin; f < group_end; ++f)
+		{
+			hash = Fnv1a(hash, &alien_formations->pos_x[f], sizeof(pos_t));
+			hash = Fnv1a(hash, &alien_formations->pos_y[f], sizeof(pos_t));
+			hash = Fnv1a(hash, &alien_formations->direction[f], sizeof(i8));
+			hash = Fnv1a(hash,
+			             &alien_formations->aliens_mask[f * ALIEN_FORMATION_NUM_ROWS],
+			             ALIEN_FORMATION_NUM_ROWS * sizeof(ALIEN_MASK_T));
+		}
+	}
+	return hash;
+}
 #endif
 
-	double previous_timestamp = engine.getStopwatchElapsedSeconds();
-	double timestamp;
-	float delta_t;
+/* Simulates and draws a single frame of the game: players, rockets, aliens and bombs.
+ * Templated on the renderer so that the same code runs headless in PerfRegression.cpp. */
+template <typename RendererT>
+void GameFrame(Game* game,
+               RendererT* renderer,
+               const Engine::PlayerInput* keys,
+               double timestamp,
+               float delta_t)
+{
+	GameState* game_state = &game->game_state;
+	ParticleSystem* rocket_systems = game->rocket_systems;
+	ParticleSystem* bomb_system = &game->bomb_system;
+	AlienFormations* alien_formations = &game->alien_formations;
 
-	while (engine.startFrame() && !game_state.game_over)
+	pos_t pos_dif = delta_t * PLAYER_MOVE_SPEED_PX_PER_SEC;
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
 	{
-		/* Get the frame timing. */
-		timestamp = engine.getStopwatchElapsedSeconds();
-		delta_t = (float)(timestamp - previous_timestamp);
+		PlayerState* player = &game_state->players[p];
+		if (!player->health)
+		{
+			/* Out of lives, the other player keeps playing. */
+			continue;
+		}
 
 		/* Check for the player input. */
-		Engine::PlayerInput keys = engine.getPlayerInput();
-		pos_t pos_dif = delta_t * PLAYER_MOVE_SPEED_PX_PER_SEC;
-		if (keys.left)
+		if (keys[p].left)
 		{
-			game_state.player_position_x -= pos_dif;
+			player->position_x -= pos_dif;
 		}
-		else if (keys.right)
+		else if (keys[p].right)
 		{
-			game_state.player_position_x += pos_dif;
+			player->position_x += pos_dif;
 		}
-		else if (keys.fire)
+		else if (keys[p].fire)
 		{
 			/* Fire only if your guns are not on cooldown. */
-			if ((timestamp - game_state.rocket_last_fired) >=
+			if ((timestamp - player->rocket_last_fired) >=
 			    game_constants::rocket_firing_cooldown)
 			{
-				game_state.rocket_last_fired = timestamp;
-				game_state.rockets_fired++;
-				AddRocket(&rocket_system, (pixel_t)game_state.player_position_x);
+				player->rocket_last_fired = timestamp;
+				player->rockets_fired++;
+				AddRocket(&rocket_systems[p], (pixel_t)player->position_x);
 			}
 		}
 
 		/* Before drawing the player, check if the player is in 'ghost' state. */
-		if (game_state.player_ghost)
+		if (player->ghost)
 		{
 			/* If the player IS in ghost state, draw it blinking so the player knows it. */
-			game_state.player_ghost_timer += delta_t;
+			player->ghost_timer += delta_t;
 			/* Draw the player blinking. */
-			if (game_state.player_ghost_timer -
-			        (game_state.player_ghost - 1) * PLAYER_DEATH_GHOST_BLINK_PERIOD >
+			if (player->ghost_timer - (player->ghost - 1) * PLAYER_DEATH_GHOST_BLINK_PERIOD >
 			    PLAYER_DEATH_GHOST_BLINK_PERIOD * 0.5f)
 			{
-				game_state.player_ghost++;
+				player->ghost++;
 			}
-			if (game_state.player_ghost & 0x01)
+			if (player->ghost & 0x01)
 			{
 				/* Draw the player */
-				engine.drawSprite(Engine::Sprite::Player,
-				                  (pixel_wide_t)game_state.player_position_x,
-				                  (pixel_wide_t)game_constants::player_position_y);
+				renderer->drawSprite(Engine::Sprite::Player,
+				                    (pixel_wide_t)player->position_x,
+				                    (pixel_wide_t)game_constants::player_position_y);
 			}
-			game_state.player_ghost *=
-			    (game_state.player_ghost < PLAYER_DEATH_GHOST_NUMBER_OF_BLINKS + 1);
+			player->ghost *= (player->ghost < PLAYER_DEATH_GHOST_NUMBER_OF_BLINKS + 1);
 		}
 		else
 		{
 			/* Draw the player */
-			engine.drawSprite(Engine::Sprite::Player,
-			                  (pixel_wide_t)game_state.player_position_x,
-			                  (pixel_wide_t)game_constants::player_position_y);
+			renderer->drawSprite(Engine::Sprite::Player,
+			                    (pixel_wide_t)player->position_x,
+			                    (pixel_wide_t)game_constants::player_position_y);
 		}
+	}
 
-		/* Update rocket positions and draw rockets in the same loop.
-		 * Normally, having two separate loops over same addresses is completely fine,
-		 * BUT since our target platform doesn't have branch predictor, we would be doing
-		 * whole lot of unnecessary comparisons. */
+	/* Update rocket positions and draw rockets in the same loop.
+	 * Normally, having two separate loops over same addresses is completely fine,
+	 * BUT since our target platform doesn't have branch predictor, we would be doing
+	 * whole lot of unnecessary comparisons. */
+	for (u8 p = 0; p < NUM_PLAYERS; ++p)
+	{
 		for (i8 i = 0; i < game_constants::max_num_rockets; ++i)
 		{
-			ParticleAttributes* attributes = &rocket_system.attributes[i];
+			ParticleAttributes* attributes = &rocket_systems[p].attributes[i];
 			u8* alive = &attributes->alive;
 			if (*alive)
 			{
@@ -444,121 +584,154 @@ void EngineMain()
 				pos_t p_y = attributes->pos_y;
 				*alive = (p_y >= 0);
 				/* Draw the rocket. */
-				engine.drawSprite(Engine::Sprite::Rocket,
-				                  (pixel_wide_t)attributes->pos_x,
-				                  (pixel_wide_t)p_y);
+				renderer->drawSprite(Engine::Sprite::Rocket,
+				                    (pixel_wide_t)attributes->pos_x,
+				                    (pixel_wide_t)p_y);
 			}
 		}
+	}
 
-		/* Draw and update the aliens and check for the collisions,
-		 * also make the decision to drop a bomb or not. */
-		{
-			/* To be used to find the leftmost and rightmost aliens. */
-			ALIEN_MASK_T alien_mask_cumulative_or = 0;
-
-			i8 bottommost_alien_row = 0;
+	/* Draw and update the aliens and check for the collisions,
+	 * also make the decision to drop a bomb or not.
+	 * Formations are processed type by type, each type being a tight loop
+	 * over its contiguous block of slots. */
+	{
+		/* Bomb drop chance this frame. */
+		float bomb_drop_chance = ALIEN_BOMB_DROP_CHANCE_EACH_SEC * delta_t;
 
-			/* pos_y corresponds to the y coordinate of the row being processed. */
-			pixel_t pos_y = (pixel_t)alien_system.pos_y;
+		/* Reused over and over again. */
+		const pixel_t x_stride = (pixel_t)Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_X;
+		const pixel_t y_stride = (pixel_t)Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_Y;
 
-			/* Bomb drop chance this frame. */
-			float bomb_drop_chance = ALIEN_BOMB_DROP_CHANCE_EACH_SEC * delta_t;
+		/* Cleared formations are replaced after all the types are processed,
+		 * so that a new formation doesn't get updated in the frame it spawns. */
+		u8 num_cleared_formations = 0;
 
-			/* Reused over and over again. */
-			const pixel_t x_stride = (pixel_t)Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_X;
-			const pixel_t y_stride = (pixel_t)Engine::SpriteSize + ALIEN_FORMATION_INNER_PADDING_Y;
+		for (u8 t = 0; t < ALIEN_NUM_TYPES; ++t)
+		{
+			const Engine::Sprite alien_sprite = ALIEN_TYPE_SPRITE[t];
+			const u8 group_begin = t * ALIEN_NUM_CONCURRENT_FORMATIONS;
 
-			for (i8 i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
+			for (u8 f = group_begin; f < group_begin + alien_formations->count[t];)
 			{
-				ALIEN_MASK_T* row = &alien_system.aliens_mask[i];
+				/* To be used to find the leftmost and rightmost aliens. */
+				ALIEN_MASK_T alien_mask_cumulative_or = 0;
 
-				/* Update the cumulative or of masks. */
-				alien_mask_cumulative_or |= *row;
+				i8 bottommost_alien_row = 0;
 
-				bottommost_alien_row |= (u8)(*row != 0) << i;
+				/* pos_y corresponds to the y coordinate of the row being processed. */
+				pixel_t pos_y = (pixel_t)alien_formations->pos_y[f];
 
-				/* pos_y corresponds to the x coordinate of the current alien being processed. */
-				pixel_t pos_x = (pixel_t)alien_system.pos_x;
+				ALIEN_MASK_T* aliens_mask =
+				    &alien_formations->aliens_mask[f * ALIEN_FORMATION_NUM_ROWS];
 
-				for (i8 j = 0; j < ALIEN_FORMATION_NUM_COLS; ++j)
+				for (i8 i = 0; i < ALIEN_FORMATION_NUM_ROWS; ++i)
 				{
-					/* If the bit is set in the row, an alien at the position of the bit
-					 * exists at that row. */
-					if (*row & ((ALIEN_MASK_T)1 << j))
+					ALIEN_MASK_T* row = &aliens_mask[i];
+
+					/* Update the cumulative or of masks. */
+					alien_mask_cumulative_or |= *row;
+
+					bottommost_alien_row |= (u8)(*row != 0) << i;
+
+					/* pos_x corresponds to the x coordinate of the current alien. */
+					pixel_t pos_x = (pixel_t)alien_formations->pos_x[f];
+
+					for (i8 j = 0; j < ALIEN_FORMATION_NUM_COLS; ++j)
 					{
-						/* Draw the alien. */
-						engine.drawSprite(alien_system.alien_sprite,
-						                  (pixel_wide_t)pos_x,
-						                  (pixel_wide_t)pos_y);
-						/* Is used to store the results of the collision tests. */
-						u8 is_destroyed = 0;
-
-						/* Make the decision to drop a bomb or not. */
+						/* If the bit is set in the row, an alien at the position of the bit
+						 * exists at that row. */
+						if (*row & ((ALIEN_MASK_T)1 << j))
 						{
-							float r = UnitRandom();
-							if (r < bomb_drop_chance)
+							/* Draw the alien. */
+							renderer->drawSprite(
+							    alien_sprite, (pixel_wide_t)pos_x, (pixel_wide_t)pos_y);
+							/* Is used to store the results of the collision tests. */
+							u8 is_destroyed = 0;
+
+							/* Make the decision to drop a bomb or not. */
 							{
-								game_state.bombs_dropped++;
-								pixel_t bomb_x = (pixel_t)(pos_x + BOMB_SPAWN_OFFSET_X);
-								pixel_t bomb_y = (pixel_t)(pos_y + BOMB_SPAWN_OFFSET_Y);
-								AddBomb(&bomb_system, bomb_x, bomb_y);
+								float r = UnitRandom();
+								if (r < bomb_drop_chance)
+								{
+									game_state->bombs_dropped++;
+									pixel_t bomb_x = (pixel_t)(pos_x + BOMB_SPAWN_OFFSET_X);
+									pixel_t bomb_y = (pixel_t)(pos_y + BOMB_SPAWN_OFFSET_Y);
+									AddBomb(bomb_system, bomb_x, bomb_y);
+								}
 							}
-						}
 
-						/* Check collision with the rockets. */
-						for (i8 k = 0; k < game_constants::max_num_rockets; ++k)
-						{
-							ParticleAttributes* attributes = &rocket_system.attributes[k];
-							u8* rocket_exists = &attributes->alive;
-							pixel_t rocket_x = attributes->pos_x;
-							pixel_t rocket_y = (pixel_t)attributes->pos_y;
-							u8 collision_test = CollisionTest((pixel_t)pos_x,
-							                                  (pixel_t)pos_y,
-							                                  rocket_x,
-							                                  rocket_y,
-							                                  ROCKET_ALIEN_COLLISION_X_DIST,
-							                                  ROCKET_ALIEN_COLLISION_Y_DIST);
-							/* Say no to branches. */
-							is_destroyed |= *rocket_exists & collision_test;
-							*rocket_exists &= (collision_test ^ 0x01);
-						}
+							/* Check collision with the rockets of every player,
+							 * the first rocket to hit gets the kill. */
+							for (u8 p = 0; p < NUM_PLAYERS; ++p)
+							{
+								ParticleAttributes* rockets = rocket_systems[p].attributes;
+								for (i8 k = 0; k < game_constants::max_num_rockets; ++k)
+								{
+									u8* rocket_exists = &rockets[k].alive;
+									pixel_t rocket_x = rockets[k].pos_x;
+									pixel_t rocket_y = (pixel_t)rockets[k].pos_y;
+									u8 collision_test =
+									    CollisionTest((pixel_t)pos_x,
+									                  (pixel_t)pos_y,
+									                  rocket_x,
+									                  rocket_y,
+									                  ROCKET_ALIEN_COLLISION_X_DIST,
+									                  ROCKET_ALIEN_COLLISION_Y_DIST);
+									/* Say no to branches. */
+									u8 kill =
+									    *rocket_exists & collision_test & (is_destroyed ^ 0x01);
+									game_state->players[p].aliens_killed += kill;
+									is_destroyed |= kill;
+									*rocket_exists &= (collision_test ^ 0x01);
+								}
+							}
 
-						/* Check collision against the player. */
-						if (!game_state.player_ghost)
-						{
-							u8 collision_test = CollisionTest((pixel_t)pos_x,
-							                                  (pixel_t)pos_y,
-							                                  (pixel_t)game_state.player_position_x,
-							                                  game_constants::player_position_y,
-							                                  ALIEN_PLAYER_COLLISION_X_DIST,
-							                                  ALIEN_PLAYER_COLLISION_Y_DIST);
-							/* We could just eliminate this branch but in this case it'd run slower
-							 * since the PlayerKilled function has 5-6 writes in it. */
-							if (collision_test & !game_state.player_ghost)
+							/* Check collision against the players. */
+							for (u8 p = 0; p < NUM_PLAYERS; ++p)
 							{
-								PlayerKilled(&game_state);
+								PlayerState* player = &game_state->players[p];
+								if (player->ghost || !player->health)
+								{
+									continue;
+								}
+								u8 collision_test =
+								    CollisionTest((pixel_t)pos_x,
+								                  (pixel_t)pos_y,
+								                  (pixel_t)player->position_x,
+								                  game_constants::player_position_y,
+								                  ALIEN_PLAYER_COLLISION_X_DIST,
+								                  ALIEN_PLAYER_COLLISION_Y_DIST);
+								/* We could just eliminate this branch but in this case
+								 * it'd run slower since the PlayerKilled function
+								 * has 5-6 writes in it. */
+								if (collision_test)
+								{
+									PlayerKilled(game_state, p);
+								}
+								/* Destroy the alien even if the player is in the ghost
+								 * state. This is just a design preference, not a bug. */
+								player->aliens_killed += collision_test & (is_destroyed ^ 0x01);
+								is_destroyed |= collision_test;
 							}
-							/* Destroy the alien even if the player is in the ghost state.
-							 * This is just a design preference, not a bug. */
-							is_destroyed |= collision_test;
-						}
 
-						/* Say no to branches. */
-						game_state.aliens_killed += is_destroyed;
-						*row &= ~((ALIEN_MASK_T)is_destroyed << j);
+							/* Say no to branches. */
+							*row &= ~((ALIEN_MASK_T)is_destroyed << j);
+						}
+						pos_x += x_stride;
 					}
-					pos_x += x_stride;
+					pos_y += y_stride;
+				}
+
+				/* If all the aliens of the formation are killed, remove it.
+				 * The last formation of this type takes its slot, so don't advance. */
+				if (!alien_mask_cumulative_or)
+				{
+					RemoveAlienFormation(alien_formations, t, f);
+					num_cleared_formations++;
+					continue;
 				}
-				pos_y += y_stride;
-			}
 
-			/* If all the aliens are killed create a new one. */
-			if (!alien_mask_cumulative_or)
-			{
-				ResetAlienSystem(&alien_system);
-			}
-			else
-			{
 				/* Find the bottommost row with at least one alien in it. */
 				{
 					unsigned long bottom_row;
@@ -567,97 +740,458 @@ void EngineMain()
 					/* If the aliens in the bottommost row cross the bottom edge of the screen,
 					 * end the game. */
 
-					pixel_t bottom_line = (pixel_t)alien_system.pos_y + Engine::SpriteSize +
-					                      (pixel_t)bottom_row * (Engine::SpriteSize +
-					                                             ALIEN_FORMATION_INNER_PADDING_Y);
+					pixel_t bottom_line = (pixel_t)alien_formations->pos_y[f] +
+					                      Engine::SpriteSize +
+					                      (pixel_t)bottom_row * y_stride;
 
-					game_state.game_over |= (bottom_line > Engine::CanvasHeight);
+					game_state->game_over |= (bottom_line > Engine::CanvasHeight);
 				}
 
-				/* Update the Alien System. This function contains no loops,
+				/* Update the formation. This function contains no loops,
 				 * instead it uses the cumulative or of alien masks from the loop above. */
-				MoveAlienSystem(&alien_system, alien_mask_cumulative_or, delta_t);
+				MoveAlienFormation(alien_formations, f, alien_mask_cumulative_or, delta_t);
+				++f;
 			}
 		}
 
-		/* Draw and update the bombs */
-		for (i8 i = 0; i < game_constants::max_num_bombs; ++i)
+		/* Keep the number of formations alive constant. Replacements wait for a spawn
+		 * position that isn't taken by a live formation. */
+		alien_formations->num_pending += num_cleared_formations;
+		SpawnPendingAlienFormations(alien_formations);
+	}
+
+	/* Draw and update the bombs */
+	for (i8 i = 0; i < game_constants::max_num_bombs; ++i)
+	{
+		ParticleAttributes* attributes = &bomb_system->attributes[i];
+		u8 alive = attributes->alive;
+		if (alive)
 		{
-			ParticleAttributes* attributes = &bomb_system.attributes[i];
-			u8 alive = attributes->alive;
-			if (alive)
+			/* Update the position.*/
+			attributes->pos_y += delta_t * BOMB_MOVE_SPEED_PX_PER_SEC;
+			pixel_t bomb_x = attributes->pos_x;
+			pixel_t bomb_y = (pixel_t)attributes->pos_y;
+			/* Set 'alive' to 0 if bombs passes the bottom of the screen. */
+			alive = (bomb_y >= Engine::CanvasHeight);
+
+			/* Draw the bomb. */
+			renderer->drawSprite(
+			    Engine::Sprite::Bomb, (pixel_wide_t)bomb_x, (pixel_wide_t)bomb_y);
+
+			/* Check collision against the players. */
+			for (u8 p = 0; p < NUM_PLAYERS; ++p)
 			{
-				/* Update the position.*/
-				attributes->pos_y += delta_t * BOMB_MOVE_SPEED_PX_PER_SEC;
-				pixel_t bomb_x = attributes->pos_x;
-				pixel_t bomb_y = (pixel_t)attributes->pos_y;
-				/* Set 'alive' to 0 if bombs passes the bottom of the screen. */
-				alive = (bomb_y >= Engine::CanvasHeight);
-
-				/* Draw the bomb. */
-				engine.drawSprite(Engine::Sprite::Bomb, (pixel_wide_t)bomb_x, (pixel_wide_t)bomb_y);
-
-				/* Check collision against the player. */
+				PlayerState* player = &game_state->players[p];
 				u8 collision_test = CollisionTest(bomb_x,
 				                                  bomb_y,
-				                                  (pixel_t)game_state.player_position_x,
+				                                  (pixel_t)player->position_x,
 				                                  game_constants::player_position_y,
 				                                  PLAYER_BOMB_COLLISION_X_DIST,
 				                                  PLAYER_BOMB_COLLISION_Y_DIST);
+				collision_test &= (player->health != 0);
 				/* To avoid lots of writes, test the branch instead. */
-				if (collision_test & !game_state.player_ghost)
+				if (collision_test & !player->ghost)
 				{
-					PlayerKilled(&game_state);
+					PlayerKilled(game_state, p);
 				}
 				/* Destroy the rocket even if the player is in the ghost state. */
 				attributes->alive &= ~collision_test;
 			}
 		}
+	}
+}
+
+/* All the drawing goes through here, so the frame capture can see every draw call
+ * without touching the game code. Without FRAME_CAPTURE these are plain forwards. */
+struct Renderer
+{
+	Engine* engine;
+#if (FRAME_CAPTURE)
+	/* NULL while not capturing. */
+	FrameCapture* capture = NULL;
+#endif
+
+	inline bool startFrame()
+	{
+		bool keep_going = engine->startFrame();
+#if (FRAME_CAPTURE)
+		if (capture)
+		{
+			CaptureStartFrame(capture, engine->getStopwatchElapsedSeconds());
+		}
+#endif
+		return keep_going;
+	}
+
+	inline void drawSprite(Engine::Sprite sprite, pixel_wide_t x, pixel_wide_t y)
+	{
+		engine->drawSprite(sprite, x, y);
+#if (FRAME_CAPTURE)
+		if (capture && capture->recording)
+		{
+			CaptureSprite(capture, sprite, x, y);
+		}
+#endif
+	}
+
+	inline void drawText(const char* message, pixel_wide_t x, pixel_wide_t y)
+	{
+		engine->drawText(message, x, y);
+#if (FRAME_CAPTURE)
+		if (capture && capture->recording)
+		{
+			CaptureText(capture, message, x, y);
+		}
+#endif
+	}
+};
+
+#if (LOCKSTEP_MODE)
+/* Sprites drawn by the last simulated tick. Lockstep simulates at LOCKSTEP_TICK_RATE
+ * regardless of the render rate, so the ticks draw into this list and every rendered
+ * frame replays it, whether a tick ran in that frame or not. */
+struct DrawList
+{
+	struct DrawnSprite
+	{
+		Engine::Sprite sprite;
+		pixel_t x;
+		pixel_t y;
+	};
+
+	static const u16 max_num_sprites =
+	    NUM_PLAYERS * (1 + game_constants::max_num_rockets) + game_constants::max_num_bombs +
+	    game_constants::max_num_alien_formations * ALIEN_FORMATION_NUM_ROWS *
+	        ALIEN_FORMATION_NUM_COLS;
+
+	u16 num_sprites = 0;
+	DrawnSprite sprites[max_num_sprites];
+
+	inline void drawSprite(Engine::Sprite sprite, pixel_wide_t x, pixel_wide_t y)
+	{
+		DrawnSprite* drawn = &sprites[num_sprites];
+		drawn->sprite = sprite;
+		drawn->x = (pixel_t)x;
+		drawn->y = (pixel_t)y;
+		num_sprites++;
+	}
+
+	inline void replay(Renderer* renderer) const
+	{
+		for (u16 i = 0; i < num_sprites; ++i)
+		{
+			renderer->drawSprite(sprites[i].sprite, sprites[i].x, sprites[i].y);
+		}
+	}
+};
+#endif
+
+/* PerfRegression.cpp builds this file headless, without the engine to link against. */
+#ifndef SPACE_INVADERS_HEADLESS
+void EngineMain()
+{
+	Engine engine;
+	Renderer renderer;
+	renderer.engine = &engine;
+
+	/* Greeting part. */
+	/* Scopes help get rid of unnecessary character buffers when the game starts
+	 * AND it provides code clarity. */
+	{
+		/* Display greeting message, controls scheme and optionally, the configuration message. */
+		const char greeting_message[] = "Good Luck!";
+		pixel_wide_t greeting_text_x =
+		    (Engine::CanvasWidth - (sizeof(greeting_message) - 1) * Engine::FontWidth) / 2;
+		pixel_wide_t greeting_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2 - 150;
+
+		char controls_text[128];
+		sprintf_s(controls_text, "Controls: Left Arrow, Right Arrow, Space.");
+		pixel_wide_t controls_text_x =
+		    (Engine::CanvasWidth - (strlen(controls_text) - 1) * Engine::FontWidth) / 2;
+		pixel_wide_t controls_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2 - 50;
+
+#if (DISPLAY_CONFIGURATION)
+		char config_text[160];
+		sprintf_s(config_text,
+		          "Lives: %d\nRandom Formation: %d\nRandom Enemy: %d\nPlayer SPD: %.0f\n"
+		          "Alien SPD: %.0f\nRocket SPD: %.0f\nBomb SPD: %.0f\n"
+		          "Bomb Chance (/Alien/Sec): %.2f",
+		          PLAYER_START_HEALTH,
+		          ALIEN_RANDOM_FORMATION,
+		          ALIEN_RANDOM_ENEMY_TYPE,
+		          PLAYER_MOVE_SPEED_PX_PER_SEC,
+		          ALIENS_SPEED_PX_PER_SEC,
+		          ROCKET_MOVE_SPEED_PX_PER_SEC,
+		          BOMB_MOVE_SPEED_PX_PER_SEC,
+		          ALIEN_BOMB_DROP_CHANCE_EACH_SEC);
+		pixel_wide_t config_text_x =
+		    (Engine::CanvasWidth - (strlen(config_text) - 1) / 6 * Engine::FontWidth) / 2;
+		pixel_wide_t config_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2;
+#endif
+
+		while (true)
+		{
+			bool keep_going = renderer.startFrame();
+			if (!keep_going)
+			{
+				/* If the player hits the ESC key or closes the window, exit the game. */
+				return;
+			}
+			Engine::PlayerInput keys = engine.getPlayerInput();
+			if (keys.left || keys.right || keys.fire)
+			{
+				/* Start the actual game when player gives an input. */
+				break;
+			}
+			renderer.drawText(greeting_message, greeting_text_x, greeting_text_y);
+			renderer.drawText(controls_text, controls_text_x, controls_text_y);
+#if (DISPLAY_CONFIGURATION)
+			renderer.drawText(config_text, config_text_x, config_text_y);
+#endif
+		}
+	}
+
+#if (LOCKSTEP_MODE)
+	Lockstep lockstep;
+	u8 connection_lost = 0;
+	if (!LockstepOpen(&lockstep))
+	{
+		return;
+	}
+
+	{
+		const char waiting_message[] = "Waiting for the other player...";
+		pixel_wide_t waiting_text_x =
+		    (Engine::CanvasWidth - (sizeof(waiting_message) - 1) * Engine::FontWidth) / 2;
+		pixel_wide_t waiting_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2;
+
+		while (!LockstepPollConnection(&lockstep))
+		{
+			if (!renderer.startFrame())
+			{
+				LockstepClose(&lockstep);
+				return;
+			}
+			renderer.drawText(waiting_message, waiting_text_x, waiting_text_y);
+		}
+	}
+#endif
+
+	/* The actual game. */
+
+	/* Set up game systems. */
+
+	Game game;
+	ALLOC_GAME_ON_STACK(game)
+#if (LOCKSTEP_MODE)
+	/* Both peers have to start from the same random state, or the aliens won't match. */
+	ResetGame(&game, LOCKSTEP_RNG_SEED);
+#else
+	ResetGame(&game, (u32)rand());
+#endif
+	GameState* game_state = &game.game_state;
+
+#if (PLAYER_START_HEALTH < 10 && !LOCKSTEP_MODE)
+	/* If start health (max possible health value) is less than 10,
+	 * just put the appropriate character into the string.
+	 * So let's allocate the health text here. */
+	char health_text[] = "Lives left:  ";
+	/* Otherwise we'll use sprintf with a local buffer. */
+#endif
+
+#if (FRAME_CAPTURE)
+	/* Capture the gameplay and the game over screen, the greeting isn't worth recording. */
+	FrameCapture frame_capture;
+	if (StartFrameCapture(&frame_capture, FRAME_CAPTURE_PATH, FRAME_CAPTURE_DELTA))
+	{
+		renderer.capture = &frame_capture;
+	}
+#endif
+
+#if (LOCKSTEP_MODE)
+	/* Simulation timing comes from the tick counter, so both peers simulate the same thing.
+	 * Real time only decides how many ticks are due in a rendered frame. */
+	const float delta_t = 1.0f / LOCKSTEP_TICK_RATE;
+	double timestamp;
+	double previous_render_timestamp = engine.getStopwatchElapsedSeconds();
+	double unsimulated_time = 0.0;
+	DrawList draw_list;
+#else
+	double previous_timestamp = engine.getStopwatchElapsedSeconds();
+	double timestamp;
+	float delta_t;
+#endif
+
+	while (renderer.startFrame() && !game_state->game_over)
+	{
+		/* Get the player input. */
+		Engine::PlayerInput keys[NUM_PLAYERS];
+#if (LOCKSTEP_MODE)
+		const double render_timestamp = engine.getStopwatchElapsedSeconds();
+		unsimulated_time += render_timestamp - previous_render_timestamp;
+		previous_render_timestamp = render_timestamp;
+
+		u32 num_ticks = (u32)(unsimulated_time * LOCKSTEP_TICK_RATE);
+		unsimulated_time -= num_ticks * (double)delta_t;
+		if (num_ticks > LOCKSTEP_MAX_TICKS_PER_FRAME)
+		{
+			num_ticks = LOCKSTEP_MAX_TICKS_PER_FRAME;
+			unsimulated_time = 0.0;
+		}
+
+		/* Drain the socket every rendered frame, not only when a tick is due, so packets
+		 * are stamped close to their arrival and the round trip measures the link. */
+		LockstepReceive(&lockstep);
+
+		/* The input is sampled once per rendered frame and used for all of its ticks. */
+		const Engine::PlayerInput local_input = engine.getPlayerInput();
+		const u32 stall_frames = lockstep.stall_frames;
+		for (u32 tick = 0; tick < num_ticks && !game_state->game_over; ++tick)
+		{
+			LockstepAddLocalInput(&lockstep, local_input);
+			if (!LockstepWaitForInputs(&lockstep, keys))
+			{
+				/* The other player is gone. */
+				connection_lost = 1;
+				game_state->game_over = 1;
+				break;
+			}
+			timestamp = lockstep.frame * (double)delta_t;
+
+			draw_list.num_sprites = 0;
+			GameFrame(&game, &draw_list, keys, timestamp, delta_t);
+
+			LockstepEndFrame(&lockstep, HashGame(&game));
+		}
+		if (connection_lost)
+		{
+			break;
+		}
+		/* If we had to wait for the other player, we're ahead of it.
+		 * Catching up with the time spent waiting would only put us ahead again. */
+		if (lockstep.stall_frames != stall_frames)
+		{
+			previous_render_timestamp = engine.getStopwatchElapsedSeconds();
+			unsimulated_time = 0.0;
+		}
+
+		draw_list.replay(&renderer);
+#else
+		/* Get the frame timing. */
+		timestamp = engine.getStopwatchElapsedSeconds();
+		delta_t = (float)(timestamp - previous_timestamp);
+
+		keys[0] = engine.getPlayerInput();
+
+		GameFrame(&game, &renderer, keys, timestamp, delta_t);
+#endif
 
 		/* Draw the text. */
+#if (LOCKSTEP_MODE)
+		/* Player 1 on the left, player 2 on the right, connection stats in the middle. */
+		for (u8 p = 0; p < NUM_PLAYERS; ++p)
+		{
+			char player_text_buf[48];
+			sprintf_s(player_text_buf,
+			          "P%d%s Lives: %d Score: %d",
+			          p + 1,
+			          p == lockstep.local_player ? " (You)" : "",
+			          (i32)game_state->players[p].health,
+			          (i32)game_state->players[p].aliens_killed);
+			pixel_wide_t player_text_x =
+			    p ? Engine::CanvasWidth - strlen(player_text_buf) * Engine::FontWidth - 5 : 5;
+			renderer.drawText(player_text_buf, player_text_x, 5);
+		}
+
+		char net_text_buf[64];
+		sprintf_s(net_text_buf,
+		          "RTT: %d ms Stalls: %u Desyncs: %u",
+		          (i32)lockstep.rtt_ms,
+		          lockstep.stall_frames,
+		          lockstep.desyncs);
+		renderer.drawText(net_text_buf,
+		                  (Engine::CanvasWidth - strlen(net_text_buf) * Engine::FontWidth) / 2,
+		                  5 + Engine::FontRowHeight);
+#else
 #if (PLAYER_START_HEALTH < 10)
 		/* If start health (max possible health value) is less than 10,
 		 * just put the appropriate character into the string. */
-		health_text[sizeof(health_text) - 2] = (u8)game_state.player_health + '0';
-		engine.drawText(health_text, 5, 5);
+		health_text[sizeof(health_text) - 2] = (u8)game_state->players[0].health + '0';
+		renderer.drawText(health_text, 5, 5);
 #else
 		/* Otherwise, use sprintf */
 		char health_text_buf[32];
-		sprintf_s(health_text_buf, "Lives left: %d", (i32)game_state.player_health);
-		engine.drawText(health_text_buf, 5, 5);
+		sprintf_s(health_text_buf, "Lives left: %d", (i32)game_state->players[0].health);
+		renderer.drawText(health_text_buf, 5, 5);
 #endif
 
 		char score_text_buf[16];
-		sprintf_s(score_text_buf, "Score: %d", (i32)game_state.aliens_killed);
-		engine.drawText(score_text_buf,
-		                Engine::CanvasWidth - strlen(score_text_buf) * Engine::FontWidth - 5,
-		                5);
+		sprintf_s(score_text_buf, "Score: %d", (i32)game_state->players[0].aliens_killed);
+		renderer.drawText(score_text_buf,
+		                  Engine::CanvasWidth - strlen(score_text_buf) * Engine::FontWidth - 5,
+		                  5);
 
 		previous_timestamp = timestamp;
+#endif
 	}
 
 	/* Game over screen. */
 
+#if (LOCKSTEP_MODE)
+	const char* game_over_message = connection_lost ? "Connection lost!" : "Game Over!";
+	pixel_wide_t game_over_text_x =
+	    (Engine::CanvasWidth - strlen(game_over_message) * Engine::FontWidth) / 2;
+#else
 	const char game_over_message[] = "Game Over!";
 	pixel_wide_t game_over_text_x =
 	    (Engine::CanvasWidth - (sizeof(game_over_message) - 1) * Engine::FontWidth) / 2;
+#endif
 	pixel_wide_t game_over_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2 - 50;
 
+#if (LOCKSTEP_MODE)
+	char stats_text[192];
+	sprintf_s(stats_text,
+	          "P1 #Aliens killed: %d #Rockets fired: %d\n"
+	          "P2 #Aliens killed: %d #Rockets fired: %d\n#Bombs dropped: %d\n"
+	          "Stalled frames: %u Desyncs: %u",
+	          (i32)game_state->players[0].aliens_killed,
+	          (i32)game_state->players[0].rockets_fired,
+	          (i32)game_state->players[1].aliens_killed,
+	          (i32)game_state->players[1].rockets_fired,
+	          (i32)game_state->bombs_dropped,
+	          lockstep.stall_frames,
+	          lockstep.desyncs);
+#else
 	char stats_text[128];
 	sprintf_s(stats_text,
 	          "#Aliens killed: %d\n#Rockets fired: %d\n#Bombs dropped: %d",
-	          (i32)game_state.aliens_killed,
-	          (i32)game_state.rockets_fired,
-	          (i32)game_state.bombs_dropped);
+	          (i32)game_state->players[0].aliens_killed,
+	          (i32)game_state->players[0].rockets_fired,
+	          (i32)game_state->bombs_dropped);
+#endif
 	pixel_wide_t stats_text_x =
 	    (Engine::CanvasWidth - (strlen(stats_text) - 1) * Engine::FontWidth / 3) / 2;
 	pixel_wide_t stats_text_y = (Engine::CanvasHeight - Engine::FontRowHeight) / 2;
 
-	while (engine.startFrame() && game_state.game_over)
+	while (renderer.startFrame() && game_state->game_over)
 	{
-		engine.drawText(game_over_message, game_over_text_x, game_over_text_y);
-		engine.drawText(stats_text, stats_text_x, stats_text_y);
+#if (LOCKSTEP_MODE)
+		/* The other peer might still need our last inputs to reach the end. */
+		LockstepLinger(&lockstep);
+#endif
+		renderer.drawText(game_over_message, game_over_text_x, game_over_text_y);
+		renderer.drawText(stats_text, stats_text_x, stats_text_y);
 	}
 
+#if (LOCKSTEP_MODE)
+	LockstepClose(&lockstep);
+#endif
+
+#if (FRAME_CAPTURE)
+	StopFrameCapture(&frame_capture);
+	renderer.capture = NULL;
+#endif
+
 	return;
 }
+#endif